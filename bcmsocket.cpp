@@ -0,0 +1,100 @@
+#include "bcmsocket.h"
+
+
+#include <net/if.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <linux/can/bcm.h>
+
+#include <cstring>
+
+
+void can::Bcm_socket::open(const std::string& device)
+{
+  if (fd_ != -1)
+    throw Bcm_socket_error{"Already open"};
+  if (device.size() + 1 >= IFNAMSIZ)
+    throw Bcm_socket_error{"Device name too long"};
+
+  fd_ = ::socket(PF_CAN, SOCK_DGRAM, CAN_BCM);
+  if (fd_ == -1)
+    throw Bcm_socket_error{"Could not open"};
+
+  ifreq ifr;
+  std::memset(&ifr.ifr_name, 0, sizeof(ifr.ifr_name));
+  std::strcpy(ifr.ifr_name, device.c_str());
+
+  sockaddr_can addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.can_family = AF_CAN;
+  if (ioctl(fd_, SIOCGIFINDEX, &ifr) < 0) {
+    close();
+    throw Bcm_socket_error{"Error retrieving interface index"};
+  }
+  addr.can_ifindex = ifr.ifr_ifindex;
+
+  // Broadcast manager sockets are connected, not bound
+  if (::connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    close();
+    throw Bcm_socket_error{"Error while connecting socket"};
+  }
+}
+
+
+void can::Bcm_socket::close()
+{
+  if (fd_ != -1)
+    ::close(fd_);
+  fd_ = -1;
+}
+
+
+void can::Bcm_socket::start(const can_frame& frame, std::chrono::microseconds interval)
+{
+  if (interval.count() <= 0)
+    throw Bcm_socket_error{"Interval must be larger than 0"};
+  // The first frame is sent immediately, then each interval
+  setup(frame, SETTIMER | STARTTIMER | TX_ANNOUNCE, interval);
+}
+
+
+void can::Bcm_socket::update(const can_frame& frame, bool announce)
+{
+  // Without SETTIMER and STARTTIMER the running timer keeps its phase
+  setup(frame, announce ? TX_ANNOUNCE : 0, std::chrono::microseconds{0});
+}
+
+
+void can::Bcm_socket::stop(canid_t id)
+{
+  bcm_msg_head head;
+  std::memset(&head, 0, sizeof(head));
+  head.opcode = TX_DELETE;
+  head.can_id = id;
+  if (::write(fd_, &head, sizeof(head)) != sizeof(head))
+    throw Bcm_socket_error{"Error deleting transmission"};
+}
+
+
+void can::Bcm_socket::setup(const can_frame& frame, std::uint32_t flags,
+    std::chrono::microseconds interval)
+{
+  // The message head is followed by the frames of the job, only single frame jobs are used
+  alignas(bcm_msg_head) std::uint8_t msg[sizeof(bcm_msg_head) + sizeof(can_frame)];
+  bcm_msg_head head;
+  std::memset(&head, 0, sizeof(head));
+  head.opcode = TX_SETUP;
+  head.flags = flags;
+  head.count = 0;  // No initial burst with the first interval
+  head.ival2.tv_sec = interval.count() / 1'000'000;
+  head.ival2.tv_usec = interval.count() % 1'000'000;
+  head.can_id = frame.can_id;
+  head.nframes = 1;
+  std::memcpy(msg, &head, sizeof(head));
+  std::memcpy(msg + sizeof(head), &frame, sizeof(frame));
+  if (::write(fd_, msg, sizeof(msg)) != sizeof(msg))
+    throw Bcm_socket_error{"Error setting up transmission"};
+}
@@ -0,0 +1,61 @@
+/* Cyclic transmission of CAN frames by the kernel's broadcast manager (CAN_BCM), each frame ID is a
+ * separate job timed by a kernel hrtimer
+ */
+
+
+#ifndef CAN_BCM_SOCKET_H
+#define CAN_BCM_SOCKET_H
+
+
+#include <linux/can.h>
+
+#include <chrono>
+#include <string>
+#include <stdexcept>
+
+
+namespace can
+{
+
+
+class Bcm_socket_error : public std::runtime_error
+{
+public:
+  Bcm_socket_error(const std::string& s) : std::runtime_error{s} {}
+  Bcm_socket_error(const char* s) : std::runtime_error{s} {}
+};
+
+
+class Bcm_socket
+{
+public:
+  Bcm_socket() : fd_{-1} {}
+  ~Bcm_socket() { close(); }  // Closing the socket deletes all jobs
+
+  Bcm_socket(const Bcm_socket&) = delete;
+  Bcm_socket& operator=(const Bcm_socket&) = delete;
+  Bcm_socket(Bcm_socket&&) = delete;
+  Bcm_socket& operator=(Bcm_socket&&) = delete;
+
+  void open(const std::string& device);
+  void close();
+  int fd() const { return fd_; }
+
+  // Starts sending the frame each interval, replaces a running job of the same ID
+  void start(const can_frame& frame, std::chrono::microseconds interval);
+  // Replaces the payload of a running job without restarting its cycle, announce sends the new
+  // frame once immediately
+  void update(const can_frame& frame, bool announce = false);
+  void stop(canid_t id);
+
+private:
+  void setup(const can_frame& frame, std::uint32_t flags, std::chrono::microseconds interval);
+
+  int fd_;
+};
+
+
+}  // namespace can
+
+
+#endif  // CAN_BCM_SOCKET_H
@@ -2,11 +2,22 @@
  */
 
 
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <unistd.h>
+
 #include <cstdint>
 #include <string>
+#include <array>
 #include <vector>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <functional>
 #include <thread>
-#include <atomic>
 #include <stdexcept>
 #include <iostream>
 
@@ -14,6 +25,17 @@
 
 #include "cansocket.h"
 #include "udpsocket.h"
+#include "udppacker.h"
+#include "reactor.h"
+#include "routing.h"
+#include "matchfilter.h"
+#include "kernelgw.h"
+#include "ring.h"
+#include "shmring.h"
+#include "shmtable.h"
+#include "latency.h"
+#include "sequence.h"
+#include "uring.h"
 #include "priority.h"
 
 
@@ -25,51 +47,879 @@ struct Options
 {
   bool listen;  // Read frames from CAN bus
   bool send;  // Send frames to CAN bus
-  bool realtime;  // Set listen and/or send thread to realtime scheduling policy
+  bool realtime;  // Set gateway thread to realtime scheduling policy
   bool timestamp;  // Pass original CAN receive timestamp to remote device
-  std::string remote_ip;
+  bool hardware_time;  // Use CAN device timestamps where the driver offers them
+  int udp_version;  // UDP wire version, 1 for ms timestamps without header, 3 for compact records
+  bool fd;  // Enable CAN FD frames
+  std::vector<can_filter> filters;  // Kernel-side ID filters for frames routed to UDP
+  bool join_filters;  // Frames must match all filters instead of any
+  std::vector<sock_filter> match;  // Kernel-side payload filter program, all frames pass if empty
+  bool pack;  // Pack multiple frames into one UDP datagram
+  std::size_t pack_size;  // Max size of a packed datagram in bytes
+  std::chrono::microseconds pack_delay;  // Max time a frame is held back for packing
+  bool compress;  // Compress packed datagrams against the previous payloads of each ID
+  bool sequence;  // Number the datagrams sent to UDP
+  std::chrono::milliseconds keyframe_interval;  // Max time between compression keyframes
+  std::vector<std::string> remote_ips;  // Unicast destinations or multicast groups
+  int multicast_ttl;  // Hops of multicast datagrams
+  bool multicast_loop;  // Deliver sent multicast datagrams to local receivers
+  std::string multicast_interface;  // Device for multicast, chosen by the routing table if empty
   std::uint16_t data_port;
-  std::string can_device;
+  std::vector<std::string> can_devices;  // Channel number is the position in this list
+  std::string routes;  // Routing rules file, all frames are forwarded if empty
+  std::size_t queue_size;  // Frames queued between CAN receive and UDP transmit thread, 0 if off
+  int stats_interval;  // Seconds between statistics reports, 0 if off
+  int receive_buffer;  // Socket receive buffer size in bytes, system default if 0
+  int send_buffer;  // Socket send buffer size in bytes, system default if 0
+  int ring_blocks;  // Blocks of the memory mapped CAN receive ring, receive from socket if 0
+  bool uring;  // Use the io_uring engine instead of the reactor
+  bool busy_poll;  // Spin on non-blocking receives instead of waiting for readiness
+  bool gso;  // Send equally sized datagrams of a batch with one syscall
+  bool gro;  // Receive datagrams coalesced by the kernel
+  std::string shm;  // Shared memory ring of the frames routed to UDP, off if empty
+  std::size_t shm_size;  // Frames of the shared memory ring
+  std::string table;  // Shared memory table of the last frame of each ID received from CAN
+  std::size_t table_size;  // Slots of extended IDs in the shared memory table
+  int cpu;  // CPU the gateway thread is pinned to, not pinned if -1
+  bool bridge;  // Route frames between two CAN devices instead of CAN and UDP
+  can::Frame_mods frame_mods;  // Modifications of bridged frames
 };
 
 
-}  // namespace cangw
+constexpr std::size_t ring_block_size = 1 << 16;
+constexpr std::chrono::milliseconds ring_timeout{1};  // Max delay of a partially filled block
+
+
+struct Received_frame
+{
+  canfd_frame frame;
+  std::uint64_t time;
+  int ifindex;
+};
+
+
+using Frame_queue = util::Spsc_ring<Received_frame>;
+
+
+constexpr std::chrono::microseconds busy_poll_time{50};  // Device queue polling per UDP receive
+
+
+udp::Format wire_format(const Options& options)
+{
+  udp::Format format;
+  format.version = options.udp_version;
+  format.timestamp = options.timestamp;
+  format.hardware_time = options.hardware_time;
+  format.channel = options.can_devices.size() > 1;
+  format.compressed = options.compress;
+  format.sequence = options.sequence;
+  return format;
+}
+
+
+void print_latency(const util::Latency_histogram& latency)
+{
+  auto us = [](std::uint64_t ns) { return ns / 1000.0; };
+  std::cout << "CAN to UDP latency in us p50 " << us(latency.percentile(50)) << ", p90 "
+      << us(latency.percentile(90)) << ", p99 " << us(latency.percentile(99)) << ", p99.9 "
+      << us(latency.percentile(99.9)) << ", max " << us(latency.max()) << " ("
+      << latency.count() << " frames)" << std::endl;
+}
 
 
-void route_to_udp(can::Socket& can_socket, udp::Socket& udp_socket, std::atomic<bool>& stop,
+void print_sequence(const sockaddr_in& source, const util::Sequence_tracker& sequence)
+{
+  char address[INET_ADDRSTRLEN] = {};
+  inet_ntop(AF_INET, &source.sin_addr, address, sizeof(address));
+  std::cout << "UDP datagrams of " << address << ":" << ntohs(source.sin_port) << " received "
+      << sequence.received() << ", lost " << sequence.lost()
+      << ", duplicates " << sequence.duplicates() << ", reordered " << sequence.reordered()
+      << ", restarts " << sequence.restarts() << "\nGaps";
+  const auto& gaps = sequence.gaps();
+  for (std::size_t i=0; i<gaps.size(); ++i) {
+    if (gaps[i] == 0)
+      continue;
+    const auto first = std::uint64_t{1} << i;
+    std::cout << " " << first;
+    if (i + 1 == gaps.size())
+      std::cout << "+";
+    else if (first > 1)
+      std::cout << "-" << (first << 1) - 1;
+    std::cout << ": " << gaps[i];
+  }
+  std::cout << std::endl;
+}
+
+
+void transmit_all(can::Socket& can_socket, const canfd_frame* frames, const int* ifindices,
+    int count)
+{
+  int sent = 0;
+  while (sent < count) {
+    auto n = can_socket.transmit_batch(frames + sent, count - sent, ifindices + sent);
+    if (n <= 0)
+      break;  // Remaining frames are dropped, e.g. device queue is full
+    sent += n;
+  }
+}
+
+
+// Drains the CAN socket into the frame queue, runs in its own thread so that a slow UDP transmit
+// doesn't delay the next receive
+class Can_reader
+{
+public:
+  Can_reader(can::Socket& can_socket, Frame_queue& queue, event::Notifier& notifier,
+      bool timestamp);
+
+  void on_receive();
+
+private:
+  static constexpr int batch_size = 32;
+
+  can::Socket& can_socket_;
+  Frame_queue& queue_;
+  event::Notifier& notifier_;
+  const bool timestamp_;
+  std::array<canfd_frame, batch_size> frames_;
+  std::array<std::uint64_t, batch_size> times_;
+  std::array<int, batch_size> ifindices_;
+  std::array<Received_frame, batch_size> received_;
+};
+
+
+Can_reader::Can_reader(can::Socket& can_socket, Frame_queue& queue, event::Notifier& notifier,
     bool timestamp)
+  : can_socket_(can_socket),
+    queue_(queue),
+    notifier_(notifier),
+    timestamp_{timestamp}
+{
+}
+
+
+void Can_reader::on_receive()
+{
+  auto n = can_socket_.receive_batch(frames_.data(), timestamp_ ? times_.data() : nullptr,
+      batch_size, ifindices_.data());
+  if (n <= 0)
+    return;
+
+  for (int i=0; i<n; ++i)
+    received_[i] = Received_frame{frames_[i], timestamp_ ? times_[i] : 0, ifindices_[i]};
+  queue_.push(received_.data(), n);  // Frames that don't fit are counted as overflow
+  notifier_.notify();
+}
+
+
+// Routes frames from CAN to UDP, called by the reactor when the CAN socket is readable, when
+// frames were queued by the CAN reader or for each frame received by the io_uring engine
+class Can_to_udp
+{
+public:
+  // Datagrams are sent through the io_uring engine if given, frames are also written to the
+  // shared memory ring and received frames to the table if given
+  Can_to_udp(can::Socket& can_socket, udp::Socket& udp_socket, event::Timer& flush_timer,
+      const Options& options, const std::vector<int>& channels, const route::Table& routes,
+      event::Uring* uring = nullptr, shm::Ring_writer* ring = nullptr,
+      shm::Table_writer* table = nullptr);
+
+  void on_receive();
+  void on_queue(Frame_queue& queue, event::Notifier& notifier);
+  void on_frame(canfd_frame& frame, std::uint64_t time, int ifindex);
+  void on_flush_timer();
+  // Time from the software receive timestamp until the datagram was handed to the UDP socket
+  const util::Latency_histogram& latency() const { return latency_; }
+  std::uint64_t suppressed() const { return suppressed_; }  // Frames held back by send policies
+
+private:
+  static constexpr int batch_size = 32;
+
+  // Last frame of an ID and source channel passed by its send policy
+  struct Policy_state
+  {
+    bool passed;
+    std::chrono::steady_clock::time_point time;
+    std::uint8_t len;
+    std::array<std::uint8_t, CANFD_MAX_DLEN> data;
+  };
+
+  void route(canfd_frame& frame, std::uint64_t time, int ifindex);
+  bool pass(std::uint16_t policy, const canfd_frame& frame, std::uint8_t source);
+  void send(const canfd_frame& frame, std::uint64_t time, std::uint8_t channel);
+  void transmit(const std::uint8_t* data, std::size_t size);
+  void flush_segments();
+  void end_batch();
+  void arm_flush_timer();
+  void flush();
+  void measure(std::uint64_t time);
+
+  can::Socket& can_socket_;
+  udp::Socket& udp_socket_;
+  event::Timer& flush_timer_;
+  event::Uring* uring_;
+  shm::Ring_writer* ring_;
+  shm::Table_writer* table_;
+  const route::Table& routes_;
+  const bool udp_;  // No UDP output if only shared memory is written
+  const bool pack_;
+  const udp::Format format_;
+  const bool measure_latency_;
+  const bool timestamps_;  // Receive times are needed for the wire format or the latency
+  std::array<canfd_frame, batch_size> frames_;
+  std::array<std::uint64_t, batch_size> times_;
+  std::array<int, batch_size> ifindices_;
+  std::array<Received_frame, batch_size> queued_;
+  std::vector<int> channels_;  // Interface index of each channel
+  std::vector<Policy_state> policy_states_;  // Per policy and source channel
+  std::uint64_t suppressed_{0};
+  std::vector<std::uint8_t> buffer_;  // Single frame datagram
+  std::size_t header_size_;
+  std::uint32_t sequence_{0};  // Of single frame datagrams
+  udp::Packer packer_;
+  std::vector<std::uint64_t> packed_times_;  // Receive times of the frames in the packer
+  util::Latency_histogram latency_;
+  const bool gso_;
+  std::vector<std::uint8_t> segments_;  // Datagrams of equal size, the last may be shorter
+  std::size_t segment_size_{0};
+  int segment_count_{0};
+};
+
+
+Can_to_udp::Can_to_udp(can::Socket& can_socket, udp::Socket& udp_socket,
+    event::Timer& flush_timer, const Options& options, const std::vector<int>& channels,
+    const route::Table& routes, event::Uring* uring, shm::Ring_writer* ring,
+    shm::Table_writer* table)
+  : can_socket_(can_socket),
+    udp_socket_(udp_socket),
+    flush_timer_(flush_timer),
+    uring_{uring},
+    ring_{ring},
+    table_{table},
+    routes_(routes),
+    udp_{!options.remote_ips.empty()},
+    pack_{options.pack},
+    format_(wire_format(options)),
+    measure_latency_{options.busy_poll && !options.hardware_time},
+    timestamps_{format_.timestamp || measure_latency_ || ring_ || table_},
+    channels_(channels),
+    policy_states_(routes.policies() * channels.size(), Policy_state{false, {}, 0, {}}),
+    buffer_(udp::max_single_size()),
+    header_size_{udp::pack_header(buffer_.data(), format_)},
+    packer_{options.pack_size, options.pack_delay, format_, options.keyframe_interval},
+    gso_{options.gso}
+{
+  if (measure_latency_ && pack_)
+    packed_times_.reserve(options.pack_size / CAN_MTU + 1);
+  if (gso_)
+    segments_.reserve(udp::max_datagram_size);
+}
+
+
+void Can_to_udp::on_receive()
+{
+  // Drain up to a batch of frames per syscall, ancillary data (timestamp) is not part of payload
+  // Times are only put on the wire if the format has timestamps
+  auto n = can_socket_.receive_batch(frames_.data(), timestamps_ ? times_.data() : nullptr,
+      batch_size, ifindices_.data());
+  for (int i=0; i<n; ++i)
+    route(frames_[i], timestamps_ ? times_[i] : 0, ifindices_[i]);
+  end_batch();
+}
+
+
+void Can_to_udp::on_queue(Frame_queue& queue, event::Notifier& notifier)
+{
+  notifier.clear();
+  std::size_t n;
+  while ((n = queue.pop(queued_.data(), queued_.size())) > 0) {
+    for (std::size_t i=0; i<n; ++i)
+      route(queued_[i].frame, queued_[i].time, queued_[i].ifindex);
+  }
+  end_batch();
+}
+
+
+void Can_to_udp::on_frame(canfd_frame& frame, std::uint64_t time, int ifindex)
+{
+  route(frame, timestamps_ ? time : 0, ifindex);
+  end_batch();
+}
+
+
+void Can_to_udp::route(canfd_frame& frame, std::uint64_t time, int ifindex)
+{
+  // Frames of interfaces not routed by this gateway are dropped when bound to all interfaces
+  auto channel = std::find(channels_.begin(), channels_.end(), ifindex);
+  if (channel == channels_.end())
+    return;
+  std::uint8_t tag = channel - channels_.begin();
+  // The last-value table is updated once per received frame, before rules and policies
+  if (table_)
+    table_->update(frame, time, tag);
+
+  const auto& rule = routes_.find(frame.can_id);
+  if (rule.policy != 0 && !pass(rule.policy, frame, tag))
+    return;
+  switch (rule.action) {
+    case route::Action::drop:
+      return;
+    case route::Action::rewrite:
+      frame.can_id = (frame.can_id & (CAN_RTR_FLAG | CAN_ERR_FLAG)) | rule.id;
+      break;
+    case route::Action::forward:
+      if (rule.channel != route::keep_channel)
+        tag = rule.channel;
+      break;
+    case route::Action::mirror:
+      send(frame, time, rule.channel);
+      break;
+  }
+  send(frame, time, tag);
+}
+
+
+bool Can_to_udp::pass(std::uint16_t policy, const canfd_frame& frame, std::uint8_t source)
 {
-  if (timestamp) {
-    // Pass-through of original receive timestamp for more accurate timing information of frames
-    std::vector<std::uint8_t> buffer(sizeof(std::uint64_t) + sizeof(can_frame));
-    auto* time = reinterpret_cast<std::uint64_t*>(buffer.data());
-    auto* frame = reinterpret_cast<can_frame*>(buffer.data() + sizeof(std::uint64_t));
-    while (!stop.load()) {
-      // Ancillary data (timestamp) is not part of socket payload
-      if (can_socket.receive(frame, time) == sizeof(can_frame)) {
-        udp_socket.transmit(buffer);
+  // Receive timestamps may be off, only policed IDs pay for reading the clock
+  const auto& rules = routes_.policy(policy);
+  auto& state = policy_states_[(policy - 1) * channels_.size() + source];
+  const auto now = std::chrono::steady_clock::now();
+  if (state.passed) {
+    const auto elapsed = now - state.time;
+    if (rules.min_interval.count() > 0 && elapsed < rules.min_interval) {
+      ++suppressed_;
+      return false;
+    }
+    if (rules.on_change && (rules.heartbeat.count() == 0 || elapsed < rules.heartbeat)) {
+      bool changed = frame.len != state.len;
+      for (int i=0; i<frame.len && !changed; ++i)
+        changed = ((frame.data[i] ^ state.data[i]) & rules.mask[i]) != 0;
+      if (!changed) {
+        ++suppressed_;
+        return false;
       }
     }
   }
-  else {
-    can_frame frame;
-    while (!stop.load()) {
-      if (can_socket.receive(&frame) == sizeof(can_frame)) {
-        udp_socket.transmit(&frame);
+  state.passed = true;
+  state.time = now;
+  state.len = std::min<std::uint8_t>(frame.len, CANFD_MAX_DLEN);
+  std::copy(frame.data, frame.data + state.len, state.data.begin());
+  return true;
+}
+
+
+void Can_to_udp::end_batch()
+{
+  flush_segments();
+  udp_socket_.transmit_queued();
+  if (ring_)
+    ring_->publish();  // Readers are woken once per batch
+  arm_flush_timer();
+}
+
+
+void Can_to_udp::arm_flush_timer()
+{
+  // Frames are collected until the datagram is full or the oldest frame reached the max delay
+  if (pack_ && !packer_.empty() && !flush_timer_.armed())
+    flush_timer_.arm(packer_.remaining(udp::Packer::Clock::now()));
+}
+
+
+void Can_to_udp::send(const canfd_frame& frame, std::uint64_t time, std::uint8_t channel)
+{
+  if (ring_)
+    ring_->write(frame, time, channel);
+  if (!udp_)
+    return;
+  if (!pack_) {
+    if (format_.sequence)
+      udp::set_stream_sequence(buffer_.data(), sequence_++);
+    auto size = udp::pack(buffer_.data() + header_size_, frame, time, channel, format_);
+    transmit(buffer_.data(), header_size_ + size);
+    measure(time);
+    return;
+  }
+  if (!packer_.append(frame, time, channel)) {
+    flush();
+    packer_.append(frame, time, channel);
+  }
+  if (measure_latency_)
+    packed_times_.push_back(time);
+}
+
+
+void Can_to_udp::on_flush_timer()
+{
+  flush_timer_.clear();
+  auto now = udp::Packer::Clock::now();
+  if (packer_.expired(now)) {
+    flush();
+    flush_segments();
+    udp_socket_.transmit_queued();
+  }
+  else if (!packer_.empty())
+    flush_timer_.arm(packer_.remaining(now));  // Deadline moved by a flush of a full datagram
+}
+
+
+void Can_to_udp::transmit(const std::uint8_t* data, std::size_t size)
+{
+  if (gso_) {
+    // Collected until the end of the batch, the kernel splits them again (UDP GSO)
+    if (segment_count_ > 0 && (size > segment_size_ || segment_count_ == udp::max_segments ||
+        segments_.size() + size > udp::max_datagram_size))
+      flush_segments();
+    if (segment_count_ == 0)
+      segment_size_ = size;
+    segments_.insert(segments_.end(), data, data + size);
+    ++segment_count_;
+    if (size < segment_size_)
+      flush_segments();  // Only the last datagram may be shorter
+    return;
+  }
+  if (uring_)
+    udp_socket_.transmit(*uring_, data, size);  // Submitted with the next batch
+  else
+    udp_socket_.queue(data, size);  // Sent with the other datagrams of the batch
+}
+
+
+void Can_to_udp::flush_segments()
+{
+  if (segment_count_ == 0)
+    return;
+  // Segments rejected by a destination are sent to it one by one by the socket
+  if (segment_count_ == 1)
+    udp_socket_.transmit(segments_.data(), segments_.size());
+  else
+    udp_socket_.transmit(segments_.data(), segments_.size(), segment_size_);
+  segments_.clear();
+  segment_count_ = 0;
+}
+
+
+void Can_to_udp::flush()
+{
+  packer_.finish();
+  transmit(packer_.data(), packer_.size());
+  packer_.clear();
+  for (auto time : packed_times_)
+    measure(time);
+  packed_times_.clear();
+}
+
+
+void Can_to_udp::measure(std::uint64_t time)
+{
+  // Receive timestamps are CLOCK_REALTIME, the same clock as the system clock
+  if (!measure_latency_ || time == 0)
+    return;
+  auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  if (static_cast<std::uint64_t>(now) > time)
+    latency_.add(now - time);
+}
+
+
+// Routes frames from UDP to CAN, called by the reactor when the UDP socket is readable
+class Udp_to_can
+{
+public:
+  Udp_to_can(can::Socket& can_socket, udp::Socket& udp_socket, const Options& options,
+      const std::vector<int>& channels, const route::Table& routes);
+
+  // Sequence numbers and compressed payloads are tracked per sender
+  struct Stream
+  {
+    sockaddr_in source;
+    udp::Unpacker unpacker;  // Keeps the state of compressed streams
+    util::Sequence_tracker sequence;  // Of datagrams with sequence numbers
+  };
+
+  static constexpr std::size_t max_streams = 16;  // Datagrams of further senders are dropped
+
+  void on_receive();
+  void on_datagram(const std::uint8_t* data, std::size_t size, const sockaddr_in& source);
+  // Undecodable datagrams and datagrams of senders beyond max_streams
+  std::uint64_t dropped() const;
+  const std::vector<Stream>& streams() const { return streams_; }
+
+private:
+  Stream* find_stream(const sockaddr_in& source);
+  int unpack(const std::uint8_t* data, std::size_t size, int offset, const sockaddr_in& source);
+  void transmit(int count);
+
+  can::Socket& can_socket_;
+  udp::Socket& udp_socket_;
+  const bool pack_;
+  const bool gro_;
+  const int datagram_count_;
+  const std::size_t datagram_size_;
+  const std::size_t max_records_;  // Of a single datagram
+  udp::Format format_;
+  std::vector<Stream> streams_;
+  std::uint64_t unknown_streams_{0};  // Datagrams dropped
+  std::vector<std::uint8_t> buffer_;
+  std::vector<std::size_t> sizes_;
+  std::vector<std::size_t> segments_;  // Size of the datagrams coalesced by GRO
+  std::vector<sockaddr_in> sources_;
+  std::vector<canfd_frame> frames_;
+  std::vector<std::uint8_t> frame_channels_;
+  std::vector<canfd_frame> routed_frames_;  // Mirrored frames may double the count
+  std::vector<int> ifindices_;
+  std::vector<int> channels_;  // Interface index of each channel
+  const route::Table& routes_;
+};
+
+
+Udp_to_can::Udp_to_can(can::Socket& can_socket, udp::Socket& udp_socket,
+    const Options& options, const std::vector<int>& channels, const route::Table& routes)
+  : can_socket_(can_socket),
+    udp_socket_(udp_socket),
+    pack_{options.pack},
+    gro_{options.gro},
+    datagram_count_{options.pack || options.gro ? 4 : 64},
+    datagram_size_{options.gro ? udp::max_coalesced_size :
+        options.pack ? udp::max_datagram_size : udp::max_single_size()},
+    max_records_{options.pack ? udp::max_datagram_size / udp::min_record_size : 1},
+    format_(wire_format(options)),
+    buffer_(datagram_count_ * datagram_size_),
+    sizes_(datagram_count_),
+    segments_(datagram_count_),
+    sources_(datagram_count_),
+    frames_(std::max(datagram_count_ * (datagram_size_ / CAN_MTU), max_records_)),
+    frame_channels_(frames_.size()),
+    routed_frames_(frames_.size() * 2),
+    ifindices_(routed_frames_.size()),
+    channels_(channels),
+    routes_(routes)
+{
+  // Unpacked version 1 datagrams carry exactly one frame without timestamp, others use the
+  // listen format
+  format_.timestamp = format_.timestamp && (pack_ || format_.version >= 2);
+}
+
+
+void Udp_to_can::on_receive()
+{
+  // Everything that arrived with one UDP wakeup is written to the CAN bus as one batch
+  auto n = udp_socket_.receive_batch(buffer_.data(), datagram_size_, sizes_.data(),
+      datagram_count_, gro_ ? segments_.data() : nullptr, sources_.data());
+  int count = 0;
+  for (int i=0; i<n; ++i) {
+    // Coalesced datagrams are of equal size, the last may be shorter
+    const auto* data = buffer_.data() + i * datagram_size_;
+    auto segment = gro_ && segments_[i] > 0 ? segments_[i] : sizes_[i];
+    for (std::size_t offset=0; offset<sizes_[i]; offset+=segment) {
+      // Compact records are as short as 2 bytes, the batch is sent in parts if it may not fit
+      const auto size = std::min(segment, sizes_[i] - offset);
+      if (count + (pack_ ? size / udp::min_record_size : 1) > frames_.size()) {
+        transmit(count);
+        count = 0;
       }
+      count += unpack(data + offset, size, count, sources_[i]);
+    }
+  }
+  transmit(count);
+}
+
+
+void Udp_to_can::on_datagram(const std::uint8_t* data, std::size_t size,
+    const sockaddr_in& source)
+{
+  transmit(unpack(data, size, 0, source));
+}
+
+
+std::uint64_t Udp_to_can::dropped() const
+{
+  auto dropped = unknown_streams_;
+  for (const auto& stream : streams_)
+    dropped += stream.unpacker.dropped();
+  return dropped;
+}
+
+
+Udp_to_can::Stream* Udp_to_can::find_stream(const sockaddr_in& source)
+{
+  // Few senders, searched linearly, a stream is kept until the gateway stops
+  for (auto& stream : streams_) {
+    if (stream.source.sin_addr.s_addr == source.sin_addr.s_addr &&
+        stream.source.sin_port == source.sin_port)
+      return &stream;
+  }
+  if (streams_.size() == max_streams)
+    return nullptr;
+  streams_.emplace_back();
+  streams_.back().source = source;
+  return &streams_.back();
+}
+
+
+int Udp_to_can::unpack(const std::uint8_t* data, std::size_t size, int offset,
+    const sockaddr_in& source)
+{
+  // Returns the count of frames unpacked behind offset
+  std::size_t consumed = 0;
+  if (offset >= static_cast<int>(frames_.size()))
+    return 0;
+  Stream* stream = nullptr;
+  if (format_.version >= 2) {
+    stream = find_stream(source);
+    if (!stream) {
+      ++unknown_streams_;
+      return 0;
+    }
+  }
+  std::uint32_t sequence;
+  if (stream && udp::stream_sequence(data, size, sequence) && !stream->sequence.add(sequence))
+    return 0;  // Duplicates are not sent to the bus again
+  if (pack_) {
+    // Timestamps are not needed for transmission and therefore discarded
+    if (!stream) {
+      return udp::unpack(data, size, format_, &frames_[offset], nullptr,
+          &frame_channels_[offset], frames_.size() - offset);
+    }
+    return stream->unpacker.unpack(data, size, format_, &frames_[offset], nullptr,
+        &frame_channels_[offset], frames_.size() - offset);
+  }
+  if (udp::unpack(data, size, format_, &frames_[offset], nullptr, &frame_channels_[offset], 1,
+      &consumed) == 1 && consumed == size) {
+    return 1;
+  }
+  return 0;
+}
+
+
+void Udp_to_can::transmit(int count)
+{
+  // Untagged frames are channel 0, frames of unknown channels are dropped
+  int routed = 0;
+  auto route_to = [&](const canfd_frame& frame, std::uint8_t channel) {
+    if (channel >= channels_.size())
+      return;
+    routed_frames_[routed] = frame;
+    ifindices_[routed] = channels_[channel];
+    ++routed;
+  };
+  for (int i=0; i<count; ++i) {
+    auto& frame = frames_[i];
+    auto channel = frame_channels_[i];
+    const auto& rule = routes_.find(frame.can_id);
+    switch (rule.action) {
+      case route::Action::drop:
+        continue;
+      case route::Action::rewrite:
+        frame.can_id = (frame.can_id & (CAN_RTR_FLAG | CAN_ERR_FLAG)) | rule.id;
+        break;
+      case route::Action::forward:
+        if (rule.channel != route::keep_channel)
+          channel = rule.channel;
+        break;
+      case route::Action::mirror:
+        route_to(frame, rule.channel);
+        break;
     }
+    route_to(frame, channel);
+  }
+  transmit_all(can_socket_, routed_frames_.data(), ifindices_.data(), routed);
+}
+
+
+// Routes frames between two CAN devices in user space, used if the kernel's can-gw isn't available
+class Can_to_can
+{
+public:
+  Can_to_can(can::Socket& can_socket, const Options& options, const std::vector<int>& channels);
+
+  void on_receive();
+
+private:
+  static constexpr int batch_size = 32;
+
+  can::Socket& can_socket_;
+  const can::Frame_mods& frame_mods_;
+  std::array<canfd_frame, batch_size> frames_;
+  std::array<int, batch_size> ifindices_;
+  std::vector<int> channels_;  // Interface index of both devices
+};
+
+
+Can_to_can::Can_to_can(can::Socket& can_socket, const Options& options,
+    const std::vector<int>& channels)
+  : can_socket_(can_socket),
+    frame_mods_(options.frame_mods),
+    channels_(channels)
+{
+}
+
+
+void Can_to_can::on_receive()
+{
+  auto n = can_socket_.receive_batch(frames_.data(), nullptr, batch_size, ifindices_.data());
+  int count = 0;
+  for (int i=0; i<n; ++i) {
+    // Frames are sent to the other device, frames of other interfaces are dropped
+    int destination;
+    if (ifindices_[i] == channels_[0])
+      destination = channels_[1];
+    else if (ifindices_[i] == channels_[1])
+      destination = channels_[0];
+    else
+      continue;
+    if (!can::apply_frame_mods(frame_mods_, frames_[i]))
+      continue;
+    frames_[count] = frames_[i];
+    ifindices_[count] = destination;
+    ++count;
+  }
+  transmit_all(can_socket_, frames_.data(), ifindices_.data(), count);
+}
+
+
+}  // namespace cangw
+
+
+template<typename Loop>
+void run_gateway(Loop& loop)
+{
+  try {
+    loop.run();
+  }
+  catch (const std::runtime_error& e) {
+    std::cerr << e.what() << std::endl;
+  }
+}
+
+
+void spin_gateway(event::Reactor& reactor, const std::function<void()>& poll)
+{
+  try {
+    reactor.spin(poll);
+  }
+  catch (const std::runtime_error& e) {
+    std::cerr << e.what() << std::endl;
   }
 }
 
 
-void route_to_can(can::Socket& can_socket, udp::Socket& udp_socket, std::atomic<bool>& stop)
+// Blocks SIGINT and SIGTERM in this thread and threads started later, returns a signalfd for them
+int block_stop_signals()
 {
-  can_frame frame;
-  while (!stop.load()) {
-    if (udp_socket.receive(&frame) == sizeof(can_frame)) {
-      can_socket.transmit(&frame);
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+  return signalfd(-1, &signals, SFD_CLOEXEC);
+}
+
+
+// Waits for enter, the end of input or a signal of the signalfd
+void wait_for_stop(int signal_fd)
+{
+  event::Reactor reactor;
+  reactor.open();
+  if (signal_fd != -1)
+    reactor.add(signal_fd, EPOLLIN, [&](std::uint32_t) { reactor.stop(); });
+  try {
+    reactor.add(STDIN_FILENO, EPOLLIN, [&](std::uint32_t) {
+      std::cin.ignore();
+      reactor.stop();
+    });
+  }
+  catch (const event::Reactor_error&) {
+    // Input from a file can't be polled, only signals stop
+    if (signal_fd == -1)
+      return;
+  }
+  reactor.run();
+}
+
+
+bool overlapping(const can_filter& a, const can_filter& b)
+{
+  // An inverted filter matches all but a range of IDs, taken as overlapping any other filter
+  if ((a.can_id | b.can_id) & CAN_INV_FILTER)
+    return true;
+  return ((a.can_id ^ b.can_id) & a.can_mask & b.can_mask) == 0;
+}
+
+
+int run_bridge(const cangw::Options& options)
+{
+  // Kernel rules outlive the process, they are deleted on Ctrl-C and SIGTERM as well
+  const int signal_fd = block_stop_signals();
+  std::vector<int> channels;
+  for (const auto& device : options.can_devices) {
+    auto ifindex = if_nametoindex(device.c_str());
+    if (ifindex == 0)
+      throw std::runtime_error{"Unknown CAN device " + device};
+    channels.push_back(ifindex);
+  }
+  const auto devices = options.can_devices[0] + " and " + options.can_devices[1];
+
+  // One rule per direction and filter, can-gw matches a single filter per rule
+  can::Kernel_gateway kernel_gateway;
+  try {
+    kernel_gateway.open();
+    for (int i=0; i<2; ++i) {
+      if (options.filters.empty()) {
+        kernel_gateway.add(channels[i], channels[1 - i], nullptr, options.frame_mods,
+            options.fd);
+      }
+      for (const auto& filter : options.filters)
+        kernel_gateway.add(channels[i], channels[1 - i], &filter, options.frame_mods, options.fd);
     }
+    std::cout << "Routing frames between " << devices << " in the kernel\n"
+        << "Rules left behind if cangw is killed are removed with can-utils' cangw -F\n"
+        << "Press enter to stop..." << std::endl;
+    wait_for_stop(signal_fd);
+    std::cout << "Stopping gateway..." << std::endl;
+    kernel_gateway.close();  // Deletes the rules
+    ::close(signal_fd);
+    std::cout << "Program finished" << std::endl;
+    return 0;
+  }
+  catch (const can::Kernel_gateway_error& e) {
+    std::cout << "Warning: " << e.what() << ", routing in user space (can-gw module missing or "
+        "forgot sudo?)" << std::endl;
+  }
+  kernel_gateway.close();
+
+  // Frames sent by the socket itself are not received again, no loop between the devices
+  can::Socket can_socket;
+  event::Reactor reactor;
+  can_socket.open("any");
+  can_socket.bind();
+  if (options.fd)
+    can_socket.set_fd_frames(true);
+  if (!options.filters.empty())
+    can_socket.set_filters(options.filters);
+  reactor.open();
+
+  cangw::Can_to_can can_to_can{can_socket, options, channels};
+  reactor.add(can_socket.fd(), EPOLLIN, [&](std::uint32_t) { can_to_can.on_receive(); });
+  std::cout << "Routing frames between " << devices << "\nPress enter to stop..." << std::endl;
+
+  std::thread gateway{&run_gateway<event::Reactor>, std::ref(reactor)};
+  if (options.realtime) {
+    if (priority::set_realtime(gateway.native_handle()))
+      std::cout << "Gateway thread set to realtime scheduling policy" << std::endl;
+    else
+      std::cout << "Warning: Could not set scheduling policy, forgot sudo?" << std::endl;
   }
+  wait_for_stop(signal_fd);
+
+  std::cout << "Stopping gateway..." << std::endl;
+  reactor.stop();
+  gateway.join();
+  ::close(signal_fd);
+  std::cout << "Program finished" << std::endl;
+  return 0;
 }
 
 
@@ -80,6 +930,31 @@ cangw::Options parse_args(int argc, char** argv)
   options.send = false;
   options.realtime = false;
   options.timestamp = false;
+  options.hardware_time = false;
+  options.fd = false;
+  options.join_filters = false;
+  options.pack = false;
+  options.compress = false;
+  options.sequence = false;
+  options.queue_size = 0;
+  options.stats_interval = 0;
+  options.receive_buffer = 0;
+  options.send_buffer = 0;
+  options.ring_blocks = 0;
+  options.uring = false;
+  options.busy_poll = false;
+  options.gso = false;
+  options.gro = false;
+  options.shm_size = 0;
+  options.table_size = 0;
+  options.cpu = -1;
+  options.bridge = false;
+  options.multicast_loop = false;
+  int pack_delay;
+  int keyframe_interval;
+  std::vector<std::string> filters;
+  std::vector<std::string> frame_mods;
+  std::string match;
 
   try {
     cxxopts::Options cli_options{"cangw", "CAN to UDP gateway"};
@@ -88,23 +963,166 @@ cangw::Options parse_args(int argc, char** argv)
       ("s,send", "Route frames from UDP to CAN", cxxopts::value<bool>(options.send))
       ("r,realtime", "Enable realtime scheduling policy", cxxopts::value<bool>(options.realtime))
       ("t,timestamp", "Prefix UDP payload with timestamp", cxxopts::value<bool>(options.timestamp))
-      ("i,ip", "Remote device IP", cxxopts::value<std::string>(options.remote_ip))
+      ("hw-timestamp", "Use CAN device timestamps if available",
+          cxxopts::value<bool>(options.hardware_time))
+      ("udp-version", "UDP wire version, 1: ms timestamps, 2: header and ns timestamps, "
+          "3: compact",
+          cxxopts::value<int>(options.udp_version)->default_value("1"))
+      ("f,fd", "Enable CAN FD frames", cxxopts::value<bool>(options.fd))
+      ("filter", "Hex ID filter <id>[:<mask>|~<mask>], may be repeated",
+          cxxopts::value<std::vector<std::string>>(filters))
+      ("join-filters", "Frames must match all filters", cxxopts::value<bool>(options.join_filters))
+      ("match", "Match expression for frames routed to UDP, e.g. \"id==0x1F6 && data[0]&0x01\"",
+          cxxopts::value<std::string>(match))
+      ("k,pack", "Pack multiple frames into one UDP datagram", cxxopts::value<bool>(options.pack))
+      ("pack-size", "Max packed datagram size in bytes",
+          cxxopts::value<std::size_t>(options.pack_size)->default_value("1472"))
+      ("pack-delay", "Max packing delay in us", cxxopts::value<int>(pack_delay)
+          ->default_value("1000"))
+      ("compress", "Compress packed datagrams of UDP wire version 3, decoded by cangw -s",
+          cxxopts::value<bool>(options.compress))
+      ("keyframe", "Max ms between compression keyframes, which end the loss of a datagram",
+          cxxopts::value<int>(keyframe_interval)->default_value("1000"))
+      ("sequence", "Number the datagrams, the receiving cangw reports losses",
+          cxxopts::value<bool>(options.sequence))
+      ("routes", "Routing rules file", cxxopts::value<std::string>(options.routes))
+      ("queue", "Decouple CAN receive with a queue of this many frames",
+          cxxopts::value<std::size_t>(options.queue_size))
+      ("stats", "Report statistics each n seconds", cxxopts::value<int>(options.stats_interval))
+      ("rcvbuf", "Socket receive buffer size in bytes",
+          cxxopts::value<int>(options.receive_buffer))
+      ("sndbuf", "Socket send buffer size in bytes", cxxopts::value<int>(options.send_buffer))
+      ("ring", "Receive CAN frames from a memory mapped ring of n 64 KiB blocks",
+          cxxopts::value<int>(options.ring_blocks))
+      ("uring", "Use io_uring for socket I/O", cxxopts::value<bool>(options.uring))
+      ("busy-poll", "Spin on non-blocking receives and report the latency",
+          cxxopts::value<bool>(options.busy_poll))
+      ("cpu", "Pin the gateway thread to this CPU", cxxopts::value<int>(options.cpu))
+      ("gso", "Send the datagrams of a batch with UDP segmentation offload",
+          cxxopts::value<bool>(options.gso))
+      ("gro", "Receive datagrams coalesced by UDP generic receive offload",
+          cxxopts::value<bool>(options.gro))
+      ("shm", "Also write frames routed to UDP to a shared memory ring of this name",
+          cxxopts::value<std::string>(options.shm))
+      ("shm-size", "Frames of the shared memory ring, a power of 2",
+          cxxopts::value<std::size_t>(options.shm_size)->default_value("65536"))
+      ("table", "Keep the last frame of each ID received in a shared memory table",
+          cxxopts::value<std::string>(options.table))
+      ("table-size", "Slots of extended IDs in the shared memory table, a power of 2",
+          cxxopts::value<std::size_t>(options.table_size)->default_value("4096"))
+      ("bridge", "Route frames between two CAN devices in the kernel",
+          cxxopts::value<bool>(options.bridge))
+      ("mod", "Bridged frame modification <and|or|xor|set>:<id|len|data>:<hex>, may be repeated",
+          cxxopts::value<std::vector<std::string>>(frame_mods))
+      ("i,ip", "Remote device IP or multicast group, may be repeated",
+          cxxopts::value<std::vector<std::string>>(options.remote_ips))
+      ("multicast-ttl", "Hops of sent multicast datagrams",
+          cxxopts::value<int>(options.multicast_ttl)->default_value("1"))
+      ("multicast-loop", "Deliver sent multicast datagrams to local receivers",
+          cxxopts::value<bool>(options.multicast_loop))
+      ("multicast-if", "Device name for sending and joining multicast groups",
+          cxxopts::value<std::string>(options.multicast_interface))
       ("p,port", "UDP data port", cxxopts::value<std::uint16_t>(options.data_port))
-      ("d,device", "CAN device name", cxxopts::value<std::string>(options.can_device)
-          ->default_value("can0"))
+      ("d,device", "CAN device name, may be repeated",
+          cxxopts::value<std::vector<std::string>>(options.can_devices)->default_value("can0"))
     ;
     cli_options.parse(argc, argv);
 
-    if (cli_options.count("listen") + cli_options.count("send") == 0) {
+    if (cli_options.count("listen") + cli_options.count("send") == 0 && !options.bridge) {
       throw std::runtime_error{"Mode must be specified, use the -l or --listen "
-          "and/or -s or --send option"};
+          "and/or -s or --send option or --bridge"};
+    }
+    if (options.bridge && (options.listen || options.send)) {
+      throw std::runtime_error{"Bridge mode can't be combined with -l or -s"};
+    }
+    if (options.bridge && options.can_devices.size() != 2) {
+      throw std::runtime_error{"Bridge mode requires exactly two CAN devices"};
+    }
+    if (options.bridge && (options.join_filters || !match.empty() || !options.routes.empty())) {
+      throw std::runtime_error{"Bridge mode supports no joined filters, match expressions or "
+          "routing rules"};
+    }
+    if (!frame_mods.empty() && !options.bridge) {
+      throw std::runtime_error{"Frame modifications require --bridge"};
     }
-    if (cli_options.count("ip") == 0) {
+    // Local readers of the shared memory ring or table may be the only consumers
+    const bool udp = !options.bridge && (options.send || (options.shm.empty() &&
+        options.table.empty()) || cli_options.count("ip") > 0);
+    if (cli_options.count("ip") == 0 && udp) {
       throw std::runtime_error{"Remote IP must be specified, use the -i or --ip option"};
     }
-    if (cli_options.count("port") == 0) {
+    if (cli_options.count("port") == 0 && udp) {
       throw std::runtime_error{"UDP port must be specified, use the -p or --port option"};
     }
+    if (options.multicast_ttl < 0 || options.multicast_ttl > 255) {
+      throw std::runtime_error{"Multicast TTL must be 0 to 255"};
+    }
+    if (options.udp_version < 1 || options.udp_version > 3) {
+      throw std::runtime_error{"UDP wire version must be 1, 2 or 3"};
+    }
+    if (options.can_devices.size() > 1 && options.udp_version < 2 && !options.bridge) {
+      throw std::runtime_error{"Multiple CAN devices require UDP wire version 2 or 3"};
+    }
+    if (options.can_devices.size() > 255) {
+      throw std::runtime_error{"Too many CAN devices"};
+    }
+    for (const auto& device : options.can_devices) {
+      if (device == "any")
+        throw std::runtime_error{"Use multiple -d or --device options instead of any"};
+    }
+    if (options.stats_interval < 0) {
+      throw std::runtime_error{"Statistics interval must not be negative"};
+    }
+    if (options.receive_buffer < 0 || options.send_buffer < 0) {
+      throw std::runtime_error{"Socket buffer size must not be negative"};
+    }
+    if (options.ring_blocks < 0) {
+      throw std::runtime_error{"Ring block count must not be negative"};
+    }
+    if (options.ring_blocks > 0 && options.send) {
+      throw std::runtime_error{"A receive ring can't be combined with -s, it sees the frames sent"};
+    }
+    if (options.uring && (options.queue_size > 0 || options.ring_blocks > 0)) {
+      throw std::runtime_error{"io_uring can't be combined with a queue or a receive ring"};
+    }
+    if (options.busy_poll && (options.uring || options.queue_size > 0)) {
+      throw std::runtime_error{"Busy polling can't be combined with io_uring or a queue"};
+    }
+    if ((!options.shm.empty() || !options.table.empty()) && !options.listen) {
+      throw std::runtime_error{"The shared memory ring and table require -l"};
+    }
+    if (options.uring && (options.gso || options.gro)) {
+      throw std::runtime_error{"io_uring can't be combined with GSO or GRO"};
+    }
+    if (cli_options.count("cpu") && options.cpu < 0) {
+      throw std::runtime_error{"CPU must not be negative"};
+    }
+    if (pack_delay <= 0) {
+      throw std::runtime_error{"Packing delay must be larger than 0"};
+    }
+    if (options.compress && (!options.pack || options.udp_version != 3)) {
+      throw std::runtime_error{"Compression requires --pack and UDP wire version 3"};
+    }
+    if (options.sequence && options.udp_version < 2) {
+      throw std::runtime_error{"Sequence numbers require UDP wire version 2 or 3"};
+    }
+    if (keyframe_interval <= 0) {
+      throw std::runtime_error{"Keyframe interval must be larger than 0"};
+    }
+    options.pack_delay = std::chrono::microseconds{pack_delay};
+    options.keyframe_interval = std::chrono::milliseconds{keyframe_interval};
+    for (const auto& filter : filters)
+      options.filters.push_back(can::parse_filter(filter));
+    // can-gw routes a frame once per matching rule, the user-space fallback once in total
+    for (auto it = options.filters.begin(); options.bridge && it != options.filters.end(); ++it) {
+      if (std::any_of(options.filters.begin(), it, [&](const can_filter& f) {
+          return overlapping(f, *it); }))
+        throw std::runtime_error{"Bridge filters must not overlap"};
+    }
+    if (!match.empty())
+      options.match = can::compile_match(match);
+    for (const auto& mod : frame_mods)
+      can::parse_frame_mod(mod, options.frame_mods);
 
     return options;
   }
@@ -119,72 +1137,283 @@ int main(int argc, char** argv)
   cangw::Options options;
   can::Socket can_socket;
   udp::Socket udp_socket;
+  event::Reactor reactor;
+  event::Uring uring;  // Replaces the reactor if enabled
+  event::Timer flush_timer;  // Flushes packed datagrams after the max delay
+  event::Reactor reader_reactor;  // Services the CAN socket if frames are queued
+  event::Notifier queue_notifier;  // Signals frames pushed to the queue
+  event::Timer stats_timer;
+  shm::Ring_writer ring;  // Frames for local readers
+  shm::Table_writer table;  // Last frame of each ID for local readers
+  std::vector<int> channels;  // Interface index of each CAN device
+  route::Tables routes;
 
   try {
     options = parse_args(argc, argv);
-    can_socket.open(options.can_device);
-    if (options.listen) {
+    if (options.bridge)
+      return run_bridge(options);
+    if (!options.routes.empty())
+      routes = route::load_rules(options.routes);
+    // Multiple devices share a single socket bound to all interfaces
+    can_socket.open(options.can_devices.size() > 1 ? "any" : options.can_devices.front());
+    for (const auto& device : options.can_devices) {
+      auto ifindex = if_nametoindex(device.c_str());
+      if (ifindex == 0)
+        throw std::runtime_error{"Unknown CAN device " + device};
+      channels.push_back(ifindex);
+    }
+    if (options.listen)
       can_socket.bind();
-      can_socket.set_receive_timeout(3);
+    if (options.timestamp && options.hardware_time) {
+      options.hardware_time = can_socket.set_hardware_timestamp(true);
+      if (!options.hardware_time)
+        std::cout << "Warning: No hardware timestamps, using software timestamps" << std::endl;
+    }
+    else if (options.timestamp || options.busy_poll || !options.shm.empty() ||
+        !options.table.empty()) {
+      options.hardware_time = false;  // Device time is only used for timestamps on the wire
+      can_socket.set_socket_timestamp(true);  // Busy polling measures latency from receive time
+    }
+    if (options.fd)
+      can_socket.set_fd_frames(true);
+    if (!options.filters.empty())
+      can_socket.set_filters(options.filters, options.join_filters);
+    if (!options.match.empty())
+      can_socket.set_filter_program(options.match);
+    if (options.stats_interval > 0)
+      can_socket.set_drop_counter(true);
+    if (options.listen && options.ring_blocks > 0) {
+      can_socket.set_receive_ring(cangw::ring_block_size, options.ring_blocks,
+          cangw::ring_timeout);
+    }
+    if (options.listen && !options.shm.empty())
+      ring.open(options.shm, options.shm_size);
+    if (options.listen && !options.table.empty())
+      table.open(options.table, options.table_size);
+    // Transmit frames to all remote devices, one bus read feeds every consumer
+    if (!options.remote_ips.empty())
+      udp_socket.open(options.remote_ips.front(), options.data_port);
+    for (std::size_t i=1; i<options.remote_ips.size(); ++i)
+      udp_socket.add_destination(options.remote_ips[i], options.data_port);
+    bool multicast = false;
+    for (const auto& ip : options.remote_ips)
+      multicast = multicast || udp::is_multicast(ip);
+    if (options.listen && multicast) {
+      udp_socket.set_multicast(options.multicast_ttl, options.multicast_loop,
+          options.multicast_interface);
     }
-    if (options.timestamp)
-      can_socket.set_socket_timestamp(true);
-    udp_socket.open(options.remote_ip, options.data_port);  // Transmit frames to remote device
     if (options.send) {
       udp_socket.bind("0.0.0.0", options.data_port);  // Receive frames from remote device
-      udp_socket.set_receive_timeout(3);
+      for (const auto& ip : options.remote_ips) {
+        if (udp::is_multicast(ip))
+          udp_socket.join_multicast(ip, options.multicast_interface);
+      }
+    }
+    if (options.listen && options.gso && udp_socket.fd() != -1 && !udp_socket.supports_gso()) {
+      std::cout << "Warning: UDP segmentation offload not supported" << std::endl;
+      options.gso = false;
+    }
+    if (options.send && options.gro && !udp_socket.set_gro(true)) {
+      std::cout << "Warning: UDP receive offload not supported" << std::endl;
+      options.gro = false;
+    }
+    if (options.busy_poll) {
+      can_socket.set_receive_wait(false);
+      udp_socket.set_receive_wait(false);
+      if (options.send && !udp_socket.set_busy_poll(cangw::busy_poll_time))
+        std::cout << "Warning: Could not set socket busy polling, forgot sudo?" << std::endl;
+      if (options.hardware_time)
+        std::cout << "Warning: No latency report with hardware timestamps" << std::endl;
     }
+    // The kernel may clamp the sizes to net.core.rmem_max and wmem_max
+    if (options.receive_buffer > 0) {
+      std::cout << "Receive buffer sizes CAN " << can_socket.set_receive_buffer(
+          options.receive_buffer);
+      if (udp_socket.fd() != -1)
+        std::cout << ", UDP " << udp_socket.set_receive_buffer(options.receive_buffer);
+      std::cout << std::endl;
+    }
+    if (options.send_buffer > 0) {
+      std::cout << "Send buffer sizes CAN " << can_socket.set_send_buffer(options.send_buffer);
+      if (udp_socket.fd() != -1)
+        std::cout << ", UDP " << udp_socket.set_send_buffer(options.send_buffer);
+      std::cout << std::endl;
+    }
+    if (options.uring)
+      uring.open();
+    else
+      reactor.open();
+    flush_timer.open();
+    if (options.listen && options.queue_size > 0) {
+      reader_reactor.open();
+      queue_notifier.open();
+    }
+    if (options.stats_interval > 0)
+      stats_timer.open();
   }
   catch (const std::runtime_error& e) {
     std::cerr << e.what() << std::endl;
     return 1;
   }
 
-  std::cout << "Routing frames between " << options.can_device << " and " << options.remote_ip
-      << ":" << options.data_port << "\nPress enter to stop..." << std::endl;
+  std::cout << "Routing frames between ";
+  for (const auto& device : options.can_devices)
+    std::cout << device << (&device != &options.can_devices.back() ? ", " : "");
+  std::cout << " and ";
+  for (const auto& ip : options.remote_ips) {
+    std::cout << ip << ":" << options.data_port
+        << (&ip != &options.remote_ips.back() ? ", " : "");
+  }
+  if (!options.shm.empty()) {
+    std::cout << (options.remote_ips.empty() ? "" : ", ") << "shared memory " << options.shm
+        << " of " << options.shm_size << " frames";
+  }
+  if (!options.table.empty()) {
+    std::cout << (options.remote_ips.empty() && options.shm.empty() ? "" : ", ")
+        << "shared memory table " << options.table;
+  }
+  std::cout << "\nPress enter to stop..." << std::endl;
 
-  std::atomic<bool> stop{false};
-  std::thread listener{};
-  std::thread sender{};
+  // A single thread services both directions, the routers are only used by the reactor thread
+  cangw::Can_to_udp can_to_udp{can_socket, udp_socket, flush_timer, options, channels,
+      routes.to_udp, options.uring ? &uring : nullptr,
+      options.listen && !options.shm.empty() ? &ring : nullptr,
+      options.listen && !options.table.empty() ? &table : nullptr};
+  cangw::Udp_to_can udp_to_can{can_socket, udp_socket, options, channels, routes.to_can};
 
-  if (options.listen) {
-    listener = std::thread{&route_to_udp, std::ref(can_socket), std::ref(udp_socket),
-        std::ref(stop), options.timestamp};
-  }
+  // Readiness handlers run on the reactor or as multishot polls of the io_uring engine
+  auto add = [&](int fd, event::Reactor::Handler handler) {
+    if (options.uring)
+      uring.add(fd, EPOLLIN, std::move(handler));
+    else
+      reactor.add(fd, EPOLLIN, std::move(handler));
+  };
 
-  if (options.send) {
-    sender = std::thread{&route_to_can, std::ref(can_socket), std::ref(udp_socket),
-        std::ref(stop)};
+  // Optionally a reader thread receives from CAN and queues frames for the gateway thread
+  // The queue stays on the stack, its cache line aligned indices must not be allocated with new
+  cangw::Frame_queue queue{options.queue_size};
+  std::unique_ptr<cangw::Can_reader> can_reader;
+  if (options.listen && options.queue_size > 0) {
+    can_reader = std::make_unique<cangw::Can_reader>(can_socket, queue, queue_notifier,
+        options.timestamp || !options.shm.empty() || !options.table.empty());
+    reader_reactor.add(can_socket.fd(), EPOLLIN, [&](std::uint32_t) { can_reader->on_receive(); });
+    add(queue_notifier.fd(), [&](std::uint32_t) { can_to_udp.on_queue(queue, queue_notifier); });
   }
+  else if (options.listen && options.uring) {
+    can_socket.receive_multishot(uring, 256, [&](canfd_frame& frame, std::uint64_t time,
+        int ifindex) { can_to_udp.on_frame(frame, time, ifindex); });
+  }
+  else if (options.listen && !options.busy_poll) {
+    add(can_socket.fd(), [&](std::uint32_t) { can_to_udp.on_receive(); });
+  }
+  if (options.listen)
+    add(flush_timer.fd(), [&](std::uint32_t) { can_to_udp.on_flush_timer(); });
+  if (options.send && options.uring) {
+    udp_socket.receive_multishot(uring, options.pack ? udp::max_datagram_size :
+        udp::max_single_size(), 64, [&](const std::uint8_t* data, std::size_t size,
+        const sockaddr_in& source) { udp_to_can.on_datagram(data, size, source); });
+  }
+  else if (options.send && !options.busy_poll) {
+    add(udp_socket.fd(), [&](std::uint32_t) { udp_to_can.on_receive(); });
+  }
+  // Busy polling receives from both sockets in turn, only timers are left to the reactor
+  std::function<void()> poll = [&] {
+    if (options.listen)
+      can_to_udp.on_receive();
+    if (options.send)
+      udp_to_can.on_receive();
+  };
 
-  if (options.realtime) {
-    // Only attempt to set active threads to realtime scheduling policy
-    bool success = false;
+  std::chrono::seconds stats_interval{options.stats_interval};
+  std::size_t last_overflows = 0;
+  std::uint32_t last_drops = 0;
+  std::uint64_t last_dropped = 0;
+  std::uint64_t last_suppressed = 0;
+  if (options.stats_interval > 0) {
+    add(stats_timer.fd(), [&](std::uint32_t) {
+      stats_timer.clear();
+      stats_timer.arm(stats_interval);
+      auto drops = can_socket.drops();
+      std::cout << "CAN drops " << drops - last_drops << " (total " << drops << ")" << std::endl;
+      last_drops = drops;
+      if (can_reader) {
+        auto overflows = queue.overflows();
+        std::cout << "Queue depth " << queue.size() << "/" << queue.capacity()
+            << ", overflows " << overflows - last_overflows << " (total " << overflows << ")"
+            << std::endl;
+        last_overflows = overflows;
+      }
+      if (options.send && (options.udp_version >= 2 || options.pack)) {
+        auto dropped = udp_to_can.dropped();
+        if (dropped > 0 || (options.pack && options.udp_version == 3)) {
+          std::cout << "UDP datagrams dropped " << dropped - last_dropped << " (total "
+              << dropped << ")" << std::endl;
+        }
+        last_dropped = dropped;
+      }
+      if (options.listen && routes.to_udp.policies() > 0) {
+        auto suppressed = can_to_udp.suppressed();
+        std::cout << "Frames suppressed by send policies " << suppressed - last_suppressed
+            << " (total " << suppressed << ")" << std::endl;
+        last_suppressed = suppressed;
+      }
+      for (const auto& stream : udp_to_can.streams()) {
+        if (stream.sequence.received() > 0)
+          cangw::print_sequence(stream.source, stream.sequence);
+      }
+      if (options.busy_poll && options.listen && !options.hardware_time)
+        cangw::print_latency(can_to_udp.latency());
+    });
+    stats_timer.arm(stats_interval);
+  }
 
-    if (listener.joinable() && sender.joinable()) {
-      success = priority::set_realtime(listener.native_handle()) &&
-          priority::set_realtime(sender.native_handle());
-    }
-    else if (listener.joinable()) {
-      success = priority::set_realtime(listener.native_handle());
-    }
-    else if (sender.joinable()) {
-      success = priority::set_realtime(sender.native_handle());
-    }
+  std::thread gateway;
+  if (options.uring)
+    gateway = std::thread{&run_gateway<event::Uring>, std::ref(uring)};
+  else if (options.busy_poll)
+    gateway = std::thread{&spin_gateway, std::ref(reactor), std::cref(poll)};
+  else
+    gateway = std::thread{&run_gateway<event::Reactor>, std::ref(reactor)};
+  std::thread reader;
+  if (can_reader)
+    reader = std::thread{&run_gateway<event::Reactor>, std::ref(reader_reactor)};
 
-    if (success)
-      std::cout << "Gateway thread(s) set to realtime scheduling policy" << std::endl;
+  if (options.realtime) {
+    bool realtime = priority::set_realtime(gateway.native_handle());
+    if (reader.joinable())
+      realtime = priority::set_realtime(reader.native_handle()) && realtime;
+    if (realtime)
+      std::cout << "Gateway threads set to realtime scheduling policy" << std::endl;
     else
       std::cout << "Warning: Could not set scheduling policy, forgot sudo?" << std::endl;
   }
+  if (options.cpu >= 0) {
+    // Keeps the spinning thread on one core, ideally isolated from the scheduler
+    if (priority::set_affinity(gateway.native_handle(), options.cpu))
+      std::cout << "Gateway thread pinned to CPU " << priority::affinity(gateway.native_handle())
+          << std::endl;
+    else
+      std::cout << "Warning: Could not pin gateway thread to CPU " << options.cpu << std::endl;
+  }
   std::cin.ignore();  // Wait in main thread
 
   std::cout << "Stopping gateway..." << std::endl;
-  stop.store(true);
-  if (listener.joinable())
-    listener.join();
-  if (sender.joinable())
-    sender.join();
+  // Immediate wakeup, no receive timeout to wait for
+  if (options.uring)
+    uring.stop();
+  else
+    reactor.stop();
+  gateway.join();
+  if (reader.joinable()) {
+    reader_reactor.stop();
+    reader.join();
+  }
+  if (options.busy_poll && options.listen && !options.hardware_time)
+    cangw::print_latency(can_to_udp.latency());
+  for (const auto& stream : udp_to_can.streams()) {
+    if (stream.sequence.received() > 0)
+      cangw::print_sequence(stream.source, stream.sequence);
+  }
 
   std::cout << "Program finished" << std::endl;
   return 0;
@@ -2,9 +2,14 @@
  */
 
 
+#include <sys/epoll.h>
+
 #include <string>
-#include <thread>
+#include <vector>
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <thread>
 #include <stdexcept>
 #include <iostream>
 #include <iomanip>
@@ -12,66 +17,217 @@
 
 #include "cxxopts.hpp"
 #include "cansocket.h"
+#include "matchfilter.h"
+#include "reactor.h"
+#include "shmring.h"
+#include "shmtable.h"
+
+
+namespace canprint
+{
+
+
+struct Options
+{
+  std::string can_device;
+  bool fd;  // Enable CAN FD frames
+  bool hardware_time;  // Use CAN device timestamps where the driver offers them
+  std::vector<can_filter> filters;  // Kernel-side ID filters, all frames are received if empty
+  bool join_filters;  // Frames must match all filters instead of any
+  std::vector<sock_filter> match;  // Kernel-side payload filter program, all frames pass if empty
+  int receive_buffer;  // Socket receive buffer size in bytes, system default if 0
+  int ring_blocks;  // Blocks of the memory mapped receive ring, receive from socket if 0
+  std::string shm;  // Shared memory ring of a gateway to read instead of the CAN device
+  std::string table;  // Shared memory table of a gateway to print the last frames of once
+};
+
+
+constexpr std::size_t ring_block_size = 1 << 16;
+constexpr std::chrono::milliseconds ring_timeout{10};  // Max delay of a partially filled block
+constexpr std::chrono::milliseconds shm_timeout{100};  // Max delay of noticing the stop
+
 
+}  // namespace canprint
 
-void print_frame(const can_frame& frame, std::uint64_t time)
+
+void print_frame(const canfd_frame& frame, std::uint64_t time)  // Time in ns
 {
+  // Classic frames share the layout, len is the DLC for those
   std::cout << time << ',' << std::setfill(' ') << std::hex << std::setw(8) << frame.can_id
-      << std::dec  << ',' << static_cast<int>(frame.can_dlc) << ',' << std::hex << std::setfill('0');
-  for (int i=frame.can_dlc-1; i>0; --i)
+      << std::dec  << ',' << static_cast<int>(frame.len) << ',' << std::hex << std::setfill('0');
+  for (int i=frame.len-1; i>0; --i)
     std::cout << std::setw(2) << static_cast<int>(frame.data[i]) << ' ';
-  if (frame.can_dlc > 0)
+  if (frame.len > 0)
     std::cout << std::setw(2) << static_cast<int>(frame.data[0]) << '\n';
   std::cout.copyfmt(std::ios{nullptr});  // Reset format state
 }
 
 
-void print_frames(std::atomic<bool>& stop, std::string device)
+void print_frames(event::Reactor& reactor, const canprint::Options& options)
 {
   can::Socket can_socket;
   try {
-    can_socket.open(device);
+    can_socket.open(options.can_device);
     can_socket.bind();
-    can_socket.set_receive_timeout(3);
-    can_socket.set_socket_timestamp(true);
+    if (options.hardware_time) {
+      if (!can_socket.set_hardware_timestamp(true))
+        std::cout << "Warning: No hardware timestamps, using software timestamps" << std::endl;
+    }
+    else {
+      can_socket.set_socket_timestamp(true);
+    }
+    if (options.fd)
+      can_socket.set_fd_frames(true);
+    if (!options.filters.empty())
+      can_socket.set_filters(options.filters, options.join_filters);
+    if (!options.match.empty())
+      can_socket.set_filter_program(options.match);
+    if (options.receive_buffer > 0) {
+      std::cout << "Receive buffer size " << can_socket.set_receive_buffer(options.receive_buffer)
+          << std::endl;
+    }
+    can_socket.set_drop_counter(true);
+    if (options.ring_blocks > 0) {
+      can_socket.set_receive_ring(canprint::ring_block_size, options.ring_blocks,
+          canprint::ring_timeout);
+    }
   }
   catch (const can::Socket_error& e) {
     std::cerr << e.what() << std::endl;
     return;
   }
 
-  std::uint64_t time;
-  can_frame frame;
+  constexpr int batch_size = 32;
+  std::array<std::uint64_t, batch_size> times;
+  std::array<canfd_frame, batch_size> frames;
+  std::uint32_t drops = 0;
+
+  try {
+    reactor.add(can_socket.fd(), EPOLLIN, [&](std::uint32_t) {
+      auto n = can_socket.receive_batch(frames.data(), times.data(), batch_size);
+      if (n > 0) {
+        for (int i=0; i<n; ++i)
+          print_frame(frames[i], times[i]);
+        if (can_socket.drops() != drops) {
+          std::cout << "Kernel dropped " << can_socket.drops() - drops << " frames" << std::endl;
+          drops = can_socket.drops();
+        }
+      }
+      else if (n == -1) {
+        std::cout << "Unknown error" << std::endl;
+      }
+    });
+    reactor.run();  // Until stopped by main thread
+  }
+  catch (const event::Reactor_error& e) {
+    std::cerr << e.what() << std::endl;
+  }
+}
+
+
+void print_shared_frames(const std::atomic<bool>& running, const canprint::Options& options)
+{
+  shm::Ring_reader ring;
+  try {
+    ring.open(options.shm);
+  }
+  catch (const shm::Ring_error& e) {
+    std::cerr << e.what() << std::endl;
+    return;
+  }
+
+  constexpr int batch_size = 32;
+  std::array<std::uint64_t, batch_size> times;
+  std::array<canfd_frame, batch_size> frames;
+  std::uint64_t overruns = 0;
 
-  while (!stop.load()) {
-    auto n = can_socket.receive(&frame, &time);
-    if (n == CAN_MTU) {
-      print_frame(frame, time);
+  // Reading never blocks the gateway, frames overwritten before read are reported
+  while (running) {
+    if (!ring.wait(canprint::shm_timeout))
+      continue;
+    int n;
+    while ((n = ring.read(frames.data(), times.data(), nullptr, batch_size)) > 0) {
+      for (int i=0; i<n; ++i)
+        print_frame(frames[i], times[i]);
     }
-    else if (n > 0) {
-      std::cout << "Received incomplete frame (" << n << " bytes)" << std::endl;
+    if (ring.overruns() != overruns) {
+      std::cout << "Ring overrun by " << ring.overruns() - overruns << " frames" << std::endl;
+      overruns = ring.overruns();
     }
-    else if (n == -1) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK)
-        std::cout << "Receive timeout" << std::endl;
-      else
-        std::cout << "Unknown error" << std::endl;
+  }
+}
+
+
+void print_table(const canprint::Options& options)
+{
+  shm::Table_reader table;
+  try {
+    table.open(options.table);
+  }
+  catch (const shm::Table_error& e) {
+    std::cerr << e.what() << std::endl;
+    return;
+  }
+
+  // A snapshot of each ID, the gateway may update other IDs meanwhile
+  shm::Table_entry entry;
+  std::uint64_t frames = 0;
+  for (std::size_t i=0; i<table.size(); ++i) {
+    if (table.read(i, entry)) {
+      print_frame(entry.frame, entry.time);
+      frames += entry.count;
     }
   }
+  std::cout << frames << " frames received";
+  if (table.overflows() > 0)
+    std::cout << ", " << table.overflows() << " of extended IDs not in the full table";
+  std::cout << std::endl;
 }
 
 
-std::string parse_args(int argc, char** argv)
+canprint::Options parse_args(int argc, char** argv)
 {
-  std::string can_device;
+  canprint::Options options;
+  options.fd = false;
+  options.hardware_time = false;
+  options.join_filters = false;
+  options.receive_buffer = 0;
+  options.ring_blocks = 0;
+  std::vector<std::string> filters;
+  std::string match;
 
   try {
-    cxxopts::Options options{"canprint", "Prints CAN frames to console"};
-    options.add_options()
-      ("d,device", "CAN device name", cxxopts::value<std::string>(can_device)->default_value("can0"))
+    cxxopts::Options cli_options{"canprint", "Prints CAN frames to console"};
+    cli_options.add_options()
+      ("d,device", "CAN device name", cxxopts::value<std::string>(options.can_device)
+          ->default_value("can0"))
+      ("f,fd", "Enable CAN FD frames", cxxopts::value<bool>(options.fd))
+      ("hw-timestamp", "Use CAN device timestamps if available",
+          cxxopts::value<bool>(options.hardware_time))
+      ("filter", "Hex ID filter <id>[:<mask>|~<mask>], may be repeated",
+          cxxopts::value<std::vector<std::string>>(filters))
+      ("join-filters", "Frames must match all filters", cxxopts::value<bool>(options.join_filters))
+      ("match", "Match expression, e.g. \"id==0x1F6 && data[0]&0x01\"",
+          cxxopts::value<std::string>(match))
+      ("rcvbuf", "Socket receive buffer size in bytes",
+          cxxopts::value<int>(options.receive_buffer))
+      ("ring", "Receive from a memory mapped ring of n 64 KiB blocks",
+          cxxopts::value<int>(options.ring_blocks))
+      ("shm", "Print the frames of a gateway's shared memory ring of this name",
+          cxxopts::value<std::string>(options.shm))
+      ("table", "Print the last frame of each ID in a gateway's shared memory table and exit",
+          cxxopts::value<std::string>(options.table))
     ;
-    options.parse(argc, argv);
-    return can_device;
+    cli_options.parse(argc, argv);
+
+    for (const auto& filter : filters)
+      options.filters.push_back(can::parse_filter(filter));
+    if (!match.empty())
+      options.match = can::compile_match(match);
+    if (options.ring_blocks < 0)
+      throw std::runtime_error{"Ring block count must not be negative"};
+
+    return options;
   }
   catch (const cxxopts::OptionException& e) {
     throw std::runtime_error{e.what()};
@@ -81,24 +237,37 @@ std::string parse_args(int argc, char** argv)
 
 int main(int argc, char** argv)
 {
-  std::string can_device;
+  canprint::Options options;
+  event::Reactor reactor;
 
   try {
-    can_device = parse_args(argc, argv);
+    options = parse_args(argc, argv);
+    reactor.open();
   }
   catch (const std::runtime_error& e) {
     std::cerr << "Error parsing command line options:\n" << e.what() << std::endl;
     return 1;
   }
 
-  std::cout << "Printing frames from " << can_device << "\nPress enter to stop..." << std::endl;
+  if (!options.table.empty()) {
+    print_table(options);
+    return 0;
+  }
+
+  std::cout << "Printing frames from " << (options.shm.empty() ? options.can_device :
+      "shared memory " + options.shm) << "\nPress enter to stop..." << std::endl;
 
-  std::atomic<bool> stop{false};
-  std::thread printer{&print_frames, std::ref(stop), can_device};
+  std::atomic<bool> running{true};
+  std::thread printer;
+  if (options.shm.empty())
+    printer = std::thread{&print_frames, std::ref(reactor), std::cref(options)};
+  else
+    printer = std::thread{&print_shared_frames, std::cref(running), std::cref(options)};
   std::cin.ignore();  // Wait in main thread
 
   std::cout << "Stopping printer..." << std::endl;
-  stop.store(true);
+  running = false;
+  reactor.stop();
   printer.join();
 
   std::cout << "Program finished" << std::endl;
@@ -9,9 +9,14 @@
 
 #include <linux/can.h>
 #include <linux/can/raw.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
 
+#include <cstdlib>
 #include <cstring>
 
+#include "uring.h"
+
 
 namespace
 {
@@ -31,9 +36,88 @@ private:
 };
 
 
+std::uint64_t to_ns(const timespec& ts)
+{
+  return ts.tv_sec * 1'000'000'000ull + ts.tv_nsec;
+}
+
+
+void mark_fd_frame(canfd_frame* frame, int size)
+{
+  // Received size is the only reliable distinction between CAN and CAN FD frames on old kernels
+  if (size == CANFD_MTU)
+    frame->flags |= CANFD_FDF;
+  else if (size == CAN_MTU)
+    frame->flags &= ~CANFD_FDF;
+}
+
+
+std::uint64_t receive_time(msghdr* msg, std::atomic<std::uint32_t>& drops)
+{
+  // Get receive time in ns and the kernel drop counter from ancillary data
+  std::uint64_t time = 0;
+  for (auto* cmsg = CMSG_FIRSTHDR(msg);
+       cmsg && cmsg->cmsg_level == SOL_SOCKET;
+       cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_type == SCM_TIMESTAMP) {
+      timeval tv;
+      memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+      time = (tv.tv_sec * 1'000'000ull + tv.tv_usec) * 1000ull;
+    }
+    else if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      timespec ts;
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      time = to_ns(ts);
+    }
+    else if (cmsg->cmsg_type == SCM_TIMESTAMPING) {
+      // Software time at index 0, raw hardware time at index 2 if supported by the driver
+      timespec ts[3];
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      time = to_ns(ts[2]) != 0 ? to_ns(ts[2]) : to_ns(ts[0]);
+    }
+    else if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+      // Only attached once the first frame was dropped, the counter only grows
+      std::uint32_t count;
+      memcpy(&count, CMSG_DATA(cmsg), sizeof(count));
+      drops = count;
+    }
+  }
+  return time;
+}
+
+
 }  // namespace
 
 
+can_filter can::parse_filter(const std::string& s)
+{
+  auto separator = s.find_first_of(":~");
+  auto id_string = s.substr(0, separator);
+  char* end = nullptr;
+  canid_t id = std::strtoul(id_string.c_str(), &end, 16);
+  if (id_string.empty() || *end != '\0')
+    throw std::runtime_error{"Invalid filter ID: " + s};
+
+  const bool extended = id_string.size() >= 8 || id > CAN_SFF_MASK;
+  can_filter filter;
+  filter.can_id = extended ? (id & CAN_EFF_MASK) | CAN_EFF_FLAG : id;
+  filter.can_mask = extended ? CAN_EFF_FLAG | CAN_EFF_MASK : CAN_EFF_FLAG | CAN_SFF_MASK;
+
+  if (separator != std::string::npos) {
+    auto mask_string = s.substr(separator + 1);
+    filter.can_mask = std::strtoul(mask_string.c_str(), &end, 16);
+    if (mask_string.empty() || *end != '\0')
+      throw std::runtime_error{"Invalid filter mask: " + s};
+    if (extended)
+      filter.can_mask |= CAN_EFF_FLAG;  // Don't match standard frames with the same ID bits
+    if (s[separator] == '~')
+      filter.can_id |= CAN_INV_FILTER;
+  }
+
+  return filter;
+}
+
+
 void can::Socket::open(const std::string& device)
 {
   if (fd_ != -1)
@@ -50,6 +134,12 @@ void can::Socket::open(const std::string& device)
     throw Socket_error{"Device name too long"};
 
   addr_.can_family = AF_CAN;
+  if (device == "any") {
+    addr_.can_ifindex = 0;  // Binding to index 0 receives from all interfaces
+    guard.release();
+    return;
+  }
+
   ifreq ifr;
   std::memset(&ifr.ifr_name, 0, sizeof(ifr.ifr_name));
   std::strcpy(ifr.ifr_name, device.c_str());
@@ -67,6 +157,7 @@ void can::Socket::close()
   if (fd_ != -1) {
     ::close(fd_);
   }
+  ring_.close();
 
   reset();
 }
@@ -97,29 +188,205 @@ void can::Socket::set_receive_timeout(time_t timeout)
 }
 
 
+void can::Socket::set_receive_timeout(std::chrono::microseconds timeout)
+{
+  if (timeout.count() <= 0)
+    throw Socket_error{"Timeout must be larger then 0"};
+
+  timeval tv;
+  tv.tv_sec = timeout.count() / 1'000'000;
+  tv.tv_usec = timeout.count() % 1'000'000;
+  if (setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0)
+    throw Socket_error{"Error setting receive timeout"};
+}
+
+
+void can::Socket::set_fd_frames(bool enable)
+{
+  const int param = enable ? 1 : 0;
+  if (setsockopt(fd_, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &param, sizeof(param)) != 0)
+    throw Socket_error{"Error setting CAN FD frames, device not FD capable?"};
+  ring_.set_fd_frames(enable);
+}
+
+
+void can::Socket::set_filters(const std::vector<can_filter>& filters, bool join)
+{
+  ring_.set_filters(filters, join);
+  if (ring_.fd() != -1)
+    return;  // The raw socket doesn't receive when reading from the ring
+
+  if (setsockopt(fd_, SOL_CAN_RAW, CAN_RAW_FILTER, filters.data(),
+      filters.size() * sizeof(can_filter)) != 0)
+    throw Socket_error{"Error setting CAN filters"};
+
+  const int param = join ? 1 : 0;
+  if (setsockopt(fd_, SOL_CAN_RAW, CAN_RAW_JOIN_FILTERS, &param, sizeof(param)) != 0)
+    throw Socket_error{"Error setting CAN filter join, kernel too old?"};
+}
+
+
+void can::Socket::set_filter_program(const std::vector<sock_filter>& program)
+{
+  try {
+    ring_.set_filter_program(program);
+  }
+  catch (const Packet_ring_error& e) {
+    throw Socket_error{e.what()};
+  }
+  if (ring_.fd() != -1)
+    return;  // The raw socket doesn't receive when reading from the ring
+
+  sock_fprog fprog;
+  fprog.len = program.size();
+  fprog.filter = const_cast<sock_filter*>(program.data());
+  if (setsockopt(fd_, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) != 0)
+    throw Socket_error{"Error attaching filter program"};
+}
+
+
 void can::Socket::set_socket_timestamp(bool enable)
 {
   const int param = enable ? 1 : 0;
-  if (setsockopt(fd_, SOL_SOCKET, SO_TIMESTAMP, &param, sizeof(param)) != 0)
+  if (setsockopt(fd_, SOL_SOCKET, SO_TIMESTAMPNS, &param, sizeof(param)) != 0)
     throw Socket_error{"Error setting socket timestamp"};
 }
 
 
+int can::Socket::set_receive_buffer(int size)
+{
+  if (setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) != 0)
+    throw Socket_error{"Error setting receive buffer size"};
+  socklen_t len = sizeof(size);
+  getsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &size, &len);
+  return size;
+}
+
+
+int can::Socket::set_send_buffer(int size)
+{
+  if (setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) != 0)
+    throw Socket_error{"Error setting send buffer size"};
+  socklen_t len = sizeof(size);
+  getsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &size, &len);
+  return size;
+}
+
+
+void can::Socket::set_receive_ring(std::size_t block_size, int block_count,
+    std::chrono::milliseconds timeout)
+{
+  try {
+    ring_.open(addr_.can_ifindex, block_size, block_count, timeout);
+  }
+  catch (const Packet_ring_error& e) {
+    throw Socket_error{e.what()};
+  }
+
+  if (setsockopt(fd_, SOL_CAN_RAW, CAN_RAW_FILTER, nullptr, 0) != 0)
+    throw Socket_error{"Error disabling raw socket receive"};
+}
+
+
+void can::Socket::set_drop_counter(bool enable)
+{
+  const int param = enable ? 1 : 0;
+  if (setsockopt(fd_, SOL_SOCKET, SO_RXQ_OVFL, &param, sizeof(param)) != 0)
+    throw Socket_error{"Error setting drop counter"};
+  drop_counter_ = enable;
+}
+
+
+bool can::Socket::set_hardware_timestamp(bool enable)
+{
+  // Driver timestamping requires support and privileges, software time is used as fallback
+  bool hardware = false;
+  if (enable) {
+    hwtstamp_config config{};
+    config.tx_type = HWTSTAMP_TX_OFF;
+    config.rx_filter = HWTSTAMP_FILTER_ALL;
+    ifreq ifr{};
+    if (if_indextoname(addr_.can_ifindex, ifr.ifr_name)) {
+      ifr.ifr_data = reinterpret_cast<char*>(&config);
+      hardware = ioctl(fd_, SIOCSHWTSTAMP, &ifr) == 0 && config.rx_filter != HWTSTAMP_FILTER_NONE;
+    }
+  }
+
+  const int param = enable ? SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+      SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE : 0;
+  if (setsockopt(fd_, SOL_SOCKET, SO_TIMESTAMPING, &param, sizeof(param)) != 0)
+    throw Socket_error{"Error setting socket hardware timestamp"};
+
+  try {
+    ring_.set_hardware_timestamp(hardware);
+  }
+  catch (const Packet_ring_error& e) {
+    throw Socket_error{e.what()};
+  }
+
+  return hardware;
+}
+
+
 int can::Socket::transmit(const can_frame* frame)
 {
   return write(fd_, frame, sizeof(can_frame));
 }
 
 
+int can::Socket::transmit(const canfd_frame* frame)
+{
+  return write(fd_, frame, frame_size(*frame));
+}
+
+
+int can::Socket::transmit_batch(const can_frame* frames, int count)
+{
+  // Partial success is possible, e.g. when the device queue is full, the remaining frames can be
+  // passed again by the caller
+  prepare_transmit_batch(count);
+  for (int i=0; i<count; ++i) {
+    tx_iovs_[i].iov_base = const_cast<can_frame*>(&frames[i]);
+    tx_iovs_[i].iov_len = sizeof(can_frame);
+    tx_msgs_[i].msg_hdr.msg_name = &addr_;  // May point to an interface of an earlier batch
+  }
+
+  return sendmmsg(fd_, tx_msgs_.data(), count, 0);
+}
+
+
+int can::Socket::transmit_batch(const canfd_frame* frames, int count, const int* ifindices)
+{
+  prepare_transmit_batch(count);
+  for (int i=0; i<count; ++i) {
+    tx_iovs_[i].iov_base = const_cast<canfd_frame*>(&frames[i]);
+    tx_iovs_[i].iov_len = frame_size(frames[i]);
+    if (ifindices) {
+      tx_addrs_[i].can_ifindex = ifindices[i];
+      tx_msgs_[i].msg_hdr.msg_name = &tx_addrs_[i];
+    }
+    else {
+      tx_msgs_[i].msg_hdr.msg_name = &addr_;
+    }
+  }
+
+  return sendmmsg(fd_, tx_msgs_.data(), count, 0);
+}
+
+
 int can::Socket::receive(can_frame* frame)
 {
   iov_.iov_base = frame;
   iov_.iov_len = sizeof(can_frame);
   msg_.msg_namelen = sizeof(addr_);
-  msg_.msg_controllen = 0;
+  msg_.msg_controllen = drop_counter_ ? cmsg_buffer.size() : 0;
   msg_.msg_flags = 0;
 
-  return recvmsg(fd_, &msg_, 0);
+  auto len = recvmsg(fd_, &msg_, 0);
+  if (len > 0 && drop_counter_)
+    receive_time(&msg_, drops_);
+
+  return len;
 }
 
 
@@ -132,19 +399,160 @@ int can::Socket::receive(can_frame* frame, std::uint64_t* time)
   msg_.msg_flags = 0;
 
   auto len = recvmsg(fd_, &msg_, 0);
+  if (len > 0)
+    *time = receive_time(&msg_, drops_);
 
-  // Get receive time from ancillary data
-  for (auto* cmsg = CMSG_FIRSTHDR(&msg_);
-       cmsg && cmsg->cmsg_level == SOL_SOCKET;
-       cmsg = CMSG_NXTHDR(&msg_, cmsg)) {
-    if (cmsg->cmsg_type == SO_TIMESTAMP) {
-      timeval tv;
-      memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
-      *time = (tv.tv_sec * 1'000'000ull + tv.tv_usec) / 1000ull;  // Time in ms
+  return len;
+}
+
+
+int can::Socket::receive(canfd_frame* frame)
+{
+  iov_.iov_base = frame;
+  iov_.iov_len = sizeof(canfd_frame);
+  msg_.msg_namelen = sizeof(addr_);
+  msg_.msg_controllen = drop_counter_ ? cmsg_buffer.size() : 0;
+  msg_.msg_flags = 0;
+
+  auto len = recvmsg(fd_, &msg_, 0);
+  if (len > 0 && drop_counter_)
+    receive_time(&msg_, drops_);
+  mark_fd_frame(frame, len);
+
+  return len;
+}
+
+
+int can::Socket::receive(canfd_frame* frame, std::uint64_t* time)
+{
+  iov_.iov_base = frame;
+  iov_.iov_len = sizeof(canfd_frame);
+  msg_.msg_namelen = sizeof(addr_);
+  msg_.msg_controllen = cmsg_buffer.size();
+  msg_.msg_flags = 0;
+
+  auto len = recvmsg(fd_, &msg_, 0);
+  if (len > 0)
+    *time = receive_time(&msg_, drops_);
+  mark_fd_frame(frame, len);
+
+  return len;
+}
+
+
+int can::Socket::receive_batch(can_frame* frames, std::uint64_t* times, int count)
+{
+  return receive_frames(reinterpret_cast<std::uint8_t*>(frames), sizeof(can_frame), times, count);
+}
+
+
+int can::Socket::receive_batch(canfd_frame* frames, std::uint64_t* times, int count,
+    int* ifindices)
+{
+  if (ring_.fd() != -1)
+    return ring_.receive_batch(frames, times, count, ifindices);
+
+  auto n = receive_frames(reinterpret_cast<std::uint8_t*>(frames), sizeof(canfd_frame), times,
+      count);
+  for (int i=0; i<n; ++i) {
+    mark_fd_frame(&frames[i], rx_sizes_[i]);
+    if (ifindices)
+      ifindices[i] = rx_ifindices_[i];
+  }
+  return n;
+}
+
+
+void can::Socket::receive_multishot(event::Uring& uring, int count, Frame_handler handler)
+{
+  // Timestamps and the drop counter arrive as ancillary data like with recvmsg
+  uring.add_receive(fd_, sizeof(canfd_frame), count, sizeof(sockaddr_can), can::cmsg_size,
+      [this, handler](const msghdr& msg, std::size_t size) {
+        if ((size != CAN_MTU && size != CANFD_MTU) || (msg.msg_flags & MSG_TRUNC))
+          return;
+        canfd_frame frame;
+        std::memcpy(&frame, msg.msg_iov->iov_base, size);
+        mark_fd_frame(&frame, size);
+        auto time = receive_time(const_cast<msghdr*>(&msg), drops_);
+        handler(frame, time, static_cast<const sockaddr_can*>(msg.msg_name)->can_ifindex);
+      });
+}
+
+
+int can::Socket::receive_frames(std::uint8_t* frames, std::size_t frame_size,
+    std::uint64_t* times, int count)
+{
+  // Receive up to count frames with a single syscall, blocks only until the first frame arrives
+  prepare_receive_batch(count);
+  for (int i=0; i<count; ++i) {
+    rx_iovs_[i].iov_base = frames + i * frame_size;
+    rx_iovs_[i].iov_len = frame_size;
+    auto& hdr = rx_msgs_[i].msg_hdr;
+    hdr.msg_namelen = sizeof(sockaddr_can);
+    hdr.msg_controllen = times || drop_counter_ ? can::cmsg_size : 0;
+    hdr.msg_flags = 0;
+  }
+
+  auto n = recvmmsg(fd_, rx_msgs_.data(), count, receive_flags_, nullptr);
+
+  // Compact complete frames to the front, incomplete or truncated ones are dropped
+  int received = 0;
+  for (int i=0; i<n; ++i) {
+    auto len = rx_msgs_[i].msg_len;
+    if ((len != CAN_MTU && len != frame_size) || (rx_msgs_[i].msg_hdr.msg_flags & MSG_TRUNC))
+      continue;
+    if (times || drop_counter_) {
+      auto time = receive_time(&rx_msgs_[i].msg_hdr, drops_);
+      if (times)
+        times[received] = time;
     }
+    if (received != i)
+      std::memcpy(frames + received * frame_size, frames + i * frame_size, frame_size);
+    rx_sizes_[received] = len;
+    rx_ifindices_[received] = rx_addrs_[i].can_ifindex;
+    ++received;
   }
 
-  return len;
+  return n < 0 ? n : received;
+}
+
+
+void can::Socket::prepare_receive_batch(int count)
+{
+  if (count <= static_cast<int>(rx_msgs_.size()))
+    return;
+
+  rx_msgs_.assign(count, mmsghdr{});
+  rx_iovs_.assign(count, iovec{});
+  rx_cmsg_buffer_.assign(count * can::cmsg_size, 0);
+  rx_sizes_.assign(count, 0);
+  rx_addrs_.assign(count, sockaddr_can{});
+  rx_ifindices_.assign(count, 0);
+  for (int i=0; i<count; ++i) {
+    auto& hdr = rx_msgs_[i].msg_hdr;
+    hdr.msg_name = &rx_addrs_[i];
+    hdr.msg_iov = &rx_iovs_[i];
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = &rx_cmsg_buffer_[i * can::cmsg_size];
+  }
+}
+
+
+void can::Socket::prepare_transmit_batch(int count)
+{
+  if (count <= static_cast<int>(tx_msgs_.size()))
+    return;
+
+  tx_msgs_.assign(count, mmsghdr{});
+  tx_iovs_.assign(count, iovec{});
+  tx_addrs_.assign(count, addr_);
+  for (int i=0; i<count; ++i) {
+    auto& hdr = tx_msgs_[i].msg_hdr;
+    hdr.msg_name = &addr_;  // Route to the opened device, even if the socket isn't bound
+    hdr.msg_namelen = sizeof(addr_);
+    hdr.msg_iov = &tx_iovs_[i];
+    hdr.msg_iovlen = 1;
+  }
 }
 
 
@@ -154,4 +562,6 @@ void can::Socket::reset()
   addr_ = sockaddr_can{};
   iov_ = iovec{};
   msg_ = msghdr{};
+  drop_counter_ = false;
+  drops_ = 0;
 }
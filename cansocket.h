@@ -5,16 +5,52 @@
 #include <sys/socket.h>
 #include <linux/can.h>
 #include <linux/can/raw.h>
+#include <linux/filter.h>
 
+#include <cstdint>
 #include <string>
+#include <chrono>
 #include <array>
+#include <vector>
+#include <atomic>
+#include <functional>
 #include <stdexcept>
 
+#include "packetring.h"
+
+
+// Marks CAN FD frames in struct canfd_frame when used for mixed CAN / CAN FD content
+#ifndef CANFD_FDF
+#define CANFD_FDF 0x04
+#endif
+
+
+namespace event
+{
+class Uring;
+}
+
 
 namespace can
 {
 
 
+inline std::size_t frame_size(const canfd_frame& frame)
+{
+  return frame.flags & CANFD_FDF ? CANFD_MTU : CAN_MTU;
+}
+
+
+// Ancillary data of a received frame, up to three timestamps and the drop counter
+constexpr std::size_t cmsg_size = CMSG_SPACE(3 * sizeof(timespec)) +
+    CMSG_SPACE(sizeof(std::uint32_t));
+
+
+// Parses "<id>:<mask>" (match), "<id>~<mask>" (inverted match) or "<id>" (exact match) in hex,
+// IDs with 8 digits or above 0x7FF are extended IDs
+can_filter parse_filter(const std::string& s);
+
+
 class Socket_error : public std::runtime_error
 {
 public:
@@ -26,6 +62,8 @@ public:
 class Socket
 {
 public:
+  using Frame_handler = std::function<void(canfd_frame& frame, std::uint64_t time, int ifindex)>;
+
   Socket() : fd_{-1} {}
   ~Socket() { close(); }
 
@@ -34,25 +72,73 @@ public:
   Socket(Socket&&) = delete;
   Socket& operator=(Socket&&) = delete;
 
-  void open(const std::string& device);
+  void open(const std::string& device);  // Device "any" receives from all CAN interfaces
   void close();
+  int fd() const { return ring_.fd() != -1 ? ring_.fd() : fd_; }  // For an event loop
 
   void bind();
   void set_receive_timeout(time_t timeout);
-  void set_socket_timestamp(bool enable);
-
+  void set_receive_timeout(std::chrono::microseconds timeout);
+  void set_socket_timestamp(bool enable);  // Software receive time with ns resolution
+  bool set_hardware_timestamp(bool enable);  // Returns false if the driver only offers software time
+  void set_fd_frames(bool enable);
+  // Batch receives return -1 (EAGAIN) instead of blocking if no frame is queued, for busy polling
+  void set_receive_wait(bool wait) { receive_flags_ = wait ? MSG_WAITFORONE : MSG_DONTWAIT; }
+  // Kernel-side ID filter, an empty list drops all frames, join requires all filters to match
+  void set_filters(const std::vector<can_filter>& filters, bool join = false);
+  // Frames passing the ID filters must also match the BPF program, e.g. one from compile_match
+  void set_filter_program(const std::vector<sock_filter>& program);
+  // Socket buffer sizes in bytes, return the size granted by the kernel (which doubles the value)
+  int set_receive_buffer(int size);
+  int set_send_buffer(int size);
+  void set_drop_counter(bool enable);  // Frames dropped by the kernel while the buffer was full
+  std::uint32_t drops() const { return ring_.fd() != -1 ? ring_.drops() : drops_.load(); }
+  // CAN FD batch receive reads from a memory mapped packet ring instead of the socket, requires
+  // CAP_NET_RAW, the ring also sees the looped back frames transmitted by this socket
+  void set_receive_ring(std::size_t block_size, int block_count,
+      std::chrono::milliseconds timeout);
+
+  // CAN FD frames are marked with CANFD_FDF, frames without the flag are sent as classic frames
   int transmit(const can_frame* frame);
+  int transmit(const canfd_frame* frame);
+  int transmit_batch(const can_frame* frames, int count);  // Returns count of frames sent
+  // Interface indices are required for sockets opened on "any"
+  int transmit_batch(const canfd_frame* frames, int count, const int* ifindices = nullptr);
   int receive(can_frame* frame);
-  int receive(can_frame* frame, std::uint64_t* time);
+  int receive(can_frame* frame, std::uint64_t* time);  // Receive time in ns since epoch
+  int receive(canfd_frame* frame);
+  int receive(canfd_frame* frame, std::uint64_t* time);
+  int receive_batch(can_frame* frames, std::uint64_t* times, int count);  // Returns frame count
+  int receive_batch(canfd_frame* frames, std::uint64_t* times, int count,
+      int* ifindices = nullptr);  // Source interface index of each frame
+  // io_uring engine, keeps a receive posted with count buffers, time is 0 without timestamps
+  void receive_multishot(event::Uring& uring, int count, Frame_handler handler);
 
 private:
   void reset();
+  int receive_frames(std::uint8_t* frames, std::size_t frame_size, std::uint64_t* times,
+      int count);
+  void prepare_receive_batch(int count);
+  void prepare_transmit_batch(int count);
 
   int fd_;
   sockaddr_can addr_;
   iovec iov_;
   msghdr msg_;
-  std::array<uint8_t, CMSG_SPACE(sizeof(timeval))> cmsg_buffer;  // Receive time
+  std::array<uint8_t, cmsg_size> cmsg_buffer;  // Receive time and drop counter
+  bool drop_counter_{false};
+  int receive_flags_{MSG_WAITFORONE};
+  std::atomic<std::uint32_t> drops_{0};
+  std::vector<mmsghdr> rx_msgs_;
+  std::vector<iovec> rx_iovs_;
+  std::vector<std::uint8_t> rx_cmsg_buffer_;  // Ancillary data of each batch frame
+  std::vector<std::size_t> rx_sizes_;  // CAN_MTU or CANFD_MTU of each received batch frame
+  std::vector<sockaddr_can> rx_addrs_;
+  std::vector<int> rx_ifindices_;
+  std::vector<mmsghdr> tx_msgs_;  // Separate from receive, both directions may run concurrently
+  std::vector<iovec> tx_iovs_;
+  std::vector<sockaddr_can> tx_addrs_;
+  Packet_ring ring_;
 };
 
 
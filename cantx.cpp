@@ -1,9 +1,11 @@
-/* A small command line program for a one-time or cyclic transmission of a single frame
+/* A small command line program for a one-time or cyclic transmission of frames
  */
 
 
 #include <string>
-#include <tuple>
+#include <vector>
+#include <algorithm>
+#include <sstream>
 #include <chrono>
 #include <thread>
 #include <atomic>
@@ -15,9 +17,34 @@
 #include "cxxopts.hpp"
 
 #include "cansocket.h"
+#include "bcmsocket.h"
 #include "priority.h"
 
 
+namespace cantx
+{
+
+
+struct Options
+{
+  std::string can_device;
+  std::vector<can_frame> frames;
+  int cycle_time;  // In ms, send once if not larger than 0
+  bool realtime;  // Set transmitter thread to realtime scheduling policy
+  bool bcm;  // Cyclic transmission by the kernel's broadcast manager
+};
+
+
+}  // namespace cantx
+
+
+bool valid_payload(const std::string& data)
+{
+  return data.size() % 2 == 0 && data.size() <= 16 &&
+      data.find_first_not_of("0123456789abcdefABCDEF") == std::string::npos;
+}
+
+
 can_frame build_frame(const std::string& id, const std::string& data)
 {
   // Invalid inputs will result in id and data set to 0
@@ -48,8 +75,8 @@ void print_frame(const can_frame& frame)
 }
 
 
-void transmit_frame(std::atomic<bool>& transmit_cyclical, const std::string device, can_frame frame,
-    int cycle_time)
+void transmit_frames(std::atomic<bool>& transmit_cyclical, const std::string device,
+    std::vector<can_frame> frames, int cycle_time)
 {
   can::Socket can_socket;
   try {
@@ -60,46 +87,103 @@ void transmit_frame(std::atomic<bool>& transmit_cyclical, const std::string devi
     return;
   }
 
+  // Sleeping until the next deadline keeps the period from drifting by the time spent writing
+  auto deadline = std::chrono::steady_clock::now();
   do
   {
-    if (can_socket.transmit(&frame) != sizeof(frame)) {
-      std::cerr << "Socket write error" << std::endl;
-      return;
+    for (auto& frame : frames) {
+      if (can_socket.transmit(&frame) != sizeof(frame)) {
+        std::cerr << "Socket write error" << std::endl;
+        return;
+      }
     }
     if (cycle_time > 0) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(cycle_time));
+      deadline += std::chrono::milliseconds(cycle_time);
+      std::this_thread::sleep_until(deadline);
     }
   } while (transmit_cyclical.load());
 }
 
 
-std::tuple<std::string, can_frame, int, bool> parse_args(int argc, char** argv)
+void update_frames(can::Bcm_socket& bcm_socket, std::vector<can_frame>& frames)
+{
+  // Each line "<id> <payload>" replaces the payload of a running frame, an empty line stops
+  std::string line;
+  while (std::getline(std::cin, line) && !line.empty()) {
+    std::istringstream input{line};
+    std::string id;
+    std::string payload;
+    input >> id >> payload;
+    if (payload.empty() || !valid_payload(payload)) {
+      std::cout << "Invalid payload, expected <id> <payload>" << std::endl;
+      continue;
+    }
+    auto update = build_frame(id, payload);
+    auto frame = std::find_if(frames.begin(), frames.end(), [&](const can_frame& f) {
+        return f.can_id == update.can_id; });
+    if (frame == frames.end()) {
+      std::cout << "Unknown frame ID " << id << std::endl;
+      continue;
+    }
+    bcm_socket.update(update);
+    *frame = update;
+    print_frame(update);
+  }
+}
+
+
+cantx::Options parse_args(int argc, char** argv)
 {
-  std::string device;
-  std::string id;
-  std::string payload;
-  int cycle_time;
-  bool realtime = false;
+  cantx::Options options;
+  options.realtime = false;
+  options.bcm = false;
+  std::vector<std::string> ids;
+  std::vector<std::string> payloads;
 
   try {
-    cxxopts::Options options{"cantx", "CAN message transmitter"};
-    options.add_options()
-      ("i,id", "Hex frame ID", cxxopts::value<std::string>(id))
-      ("p,payload", "Hex data string", cxxopts::value<std::string>(payload)->default_value("00"))
-      ("c,cycle", "Cycle time in ms", cxxopts::value<int>(cycle_time)->default_value("-1"))
-      ("d,device", "CAN device name", cxxopts::value<std::string>(device)->default_value("can0"))
-      ("r,realtime", "Enable realtime scheduling policy", cxxopts::value<bool>(realtime))
+    cxxopts::Options cli_options{"cantx", "CAN message transmitter"};
+    cli_options.add_options()
+      ("i,id", "Hex frame ID, may be repeated", cxxopts::value<std::vector<std::string>>(ids))
+      ("p,payload", "Hex data string of the ID at the same position, may be repeated",
+          cxxopts::value<std::vector<std::string>>(payloads))
+      ("c,cycle", "Cycle time in ms", cxxopts::value<int>(options.cycle_time)
+          ->default_value("-1"))
+      ("d,device", "CAN device name", cxxopts::value<std::string>(options.can_device)
+          ->default_value("can0"))
+      ("r,realtime", "Enable realtime scheduling policy", cxxopts::value<bool>(options.realtime))
+      ("b,bcm", "Cyclic transmission by the kernel's broadcast manager",
+          cxxopts::value<bool>(options.bcm))
     ;
-    options.parse(argc, argv);
+    cli_options.parse(argc, argv);
 
-    if (options.count("id") == 0) {
+    if (cli_options.count("id") == 0) {
       throw std::runtime_error{"Message ID must be specified, use -i or --id option"};
     }
-    if (payload.size() % 2 || payload.size() > 16) {
-      throw std::runtime_error{"Payload size error, size must be even and <= 16"};
+    if (payloads.size() > ids.size()) {
+      throw std::runtime_error{"More payloads than IDs"};
+    }
+    for (const auto& payload : payloads) {
+      if (!valid_payload(payload))
+        throw std::runtime_error{"Payload size error, size must be even and <= 16"};
+    }
+    if (options.bcm && options.cycle_time <= 0) {
+      throw std::runtime_error{"Broadcast manager requires a cycle time, use -c or --cycle"};
     }
 
-    return std::make_tuple(std::move(device), build_frame(id, payload), cycle_time, realtime);
+    // IDs without payload send a single zero byte
+    payloads.resize(ids.size(), "00");
+    for (std::size_t i=0; i<ids.size(); ++i)
+      options.frames.push_back(build_frame(ids[i], payloads[i]));
+
+    // The broadcast manager keeps a single job per ID, a second one would replace the first
+    if (options.bcm) {
+      for (auto it = options.frames.begin(); it != options.frames.end(); ++it) {
+        if (std::any_of(options.frames.begin(), it, [&](const can_frame& f) {
+            return f.can_id == it->can_id; }))
+          throw std::runtime_error{"Frame IDs must be unique with the broadcast manager"};
+      }
+    }
+    return options;
   }
   catch (const cxxopts::OptionException& e) {
     throw std::runtime_error{e.what()};
@@ -109,31 +193,49 @@ std::tuple<std::string, can_frame, int, bool> parse_args(int argc, char** argv)
 
 int main(int argc, char** argv)
 {
-  std::string device;
-  can_frame frame;
-  int cycle_time;
-  bool realtime;
+  cantx::Options options;
 
   try {
-    std::tie(device, frame, cycle_time, realtime) = parse_args(argc, argv);
+    options = parse_args(argc, argv);
   }
   catch (const std::runtime_error& e) {
     std::cerr << "Error parsing command line options:\n" << e.what() << std::endl;
     return 1;
   }
 
-  std::atomic<bool> transmit_cyclical{cycle_time > 0};
+  std::atomic<bool> transmit_cyclical{options.cycle_time > 0};
 
-  std::cout << "Transmitting frame on " << device;
+  std::cout << "Transmitting " << (options.frames.size() > 1 ? "frames" : "frame") << " on "
+      << options.can_device;
   if (transmit_cyclical.load())
-    std::cout << " each " << cycle_time << " ms...";
+    std::cout << " each " << options.cycle_time << " ms...";
   std::cout << '\n';
-  print_frame(frame);
+  for (const auto& frame : options.frames)
+    print_frame(frame);
+
+  if (options.bcm) {
+    // The kernel keeps sending until the jobs are deleted by closing the socket
+    can::Bcm_socket bcm_socket;
+    try {
+      bcm_socket.open(options.can_device);
+      for (const auto& frame : options.frames)
+        bcm_socket.start(frame, std::chrono::milliseconds(options.cycle_time));
+      std::cout << "Enter <id> <payload> to update a frame, press enter to stop..." << std::endl;
+      update_frames(bcm_socket, options.frames);
+    }
+    catch (const can::Bcm_socket_error& e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+    std::cout << "Program finished" << std::endl;
+    return 0;
+  }
 
-  std::thread transmitter{&transmit_frame, std::ref(transmit_cyclical), device, frame, cycle_time};
+  std::thread transmitter{&transmit_frames, std::ref(transmit_cyclical), options.can_device,
+      options.frames, options.cycle_time};
 
   if (transmit_cyclical.load()) {
-    if (realtime) {
+    if (options.realtime) {
       if (priority::set_realtime(transmitter.native_handle()))
         std::cout << "Transmitter thread set to realtime scheduling policy\n";
       else
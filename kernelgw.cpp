@@ -0,0 +1,222 @@
+#include "kernelgw.h"
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/can/gw.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+
+namespace
+{
+
+
+void append_attribute(std::vector<std::uint8_t>& msg, std::uint16_t type, const void* data,
+    std::size_t size)
+{
+  nlattr attr;
+  attr.nla_type = type;
+  attr.nla_len = NLA_HDRLEN + size;
+  auto offset = msg.size();
+  msg.resize(offset + NLA_ALIGN(attr.nla_len));
+  std::memcpy(msg.data() + offset, &attr, sizeof(attr));
+  std::memcpy(msg.data() + offset + NLA_HDRLEN, data, size);
+}
+
+
+std::uint8_t parse_hex_byte(const std::string& s, std::size_t pos)
+{
+  char* end = nullptr;
+  auto byte = s.substr(pos, 2);
+  auto value = std::strtoul(byte.c_str(), &end, 16);
+  if (byte.size() != 2 || *end != '\0')
+    throw std::runtime_error{"Invalid hex byte in " + s};
+  return value;
+}
+
+
+}  // namespace
+
+
+void can::parse_frame_mod(const std::string& s, Frame_mods& mods)
+{
+  static const std::array<std::string, 4> functions = {"and", "or", "xor", "set"};
+  auto first = s.find(':');
+  auto second = s.find(':', first == std::string::npos ? first : first + 1);
+  if (second == std::string::npos)
+    throw std::runtime_error{"Invalid frame modification: " + s};
+
+  auto function = std::find(functions.begin(), functions.end(), s.substr(0, first));
+  if (function == functions.end())
+    throw std::runtime_error{"Unknown modification function: " + s};
+  const auto index = function - functions.begin();
+  auto field = s.substr(first + 1, second - first - 1);
+  auto value = s.substr(second + 1);
+  auto& frame = mods.frames[index];
+
+  char* end = nullptr;
+  if (field == "id") {
+    frame.can_id = std::strtoul(value.c_str(), &end, 16);
+    if (value.empty() || *end != '\0')
+      throw std::runtime_error{"Invalid ID in " + s};
+    mods.fields[index] |= CGW_MOD_ID;
+  }
+  else if (field == "len") {
+    frame.len = std::strtoul(value.c_str(), &end, 16);
+    if (value.empty() || *end != '\0')
+      throw std::runtime_error{"Invalid length in " + s};
+    mods.fields[index] |= CGW_MOD_LEN;
+  }
+  else if (field == "data") {
+    if (value.empty() || value.size() % 2 || value.size() > 2 * CANFD_MAX_DLEN)
+      throw std::runtime_error{"Invalid data in " + s};
+    for (std::size_t i=0; i<value.size() / 2; ++i)
+      frame.data[i] = parse_hex_byte(value, i * 2);
+    mods.fields[index] |= CGW_MOD_DATA;
+  }
+  else {
+    throw std::runtime_error{"Unknown modification field: " + s};
+  }
+}
+
+
+bool can::apply_frame_mods(const Frame_mods& mods, canfd_frame& frame)
+{
+  auto modify = [](auto& target, auto operand, int function) {
+    switch (function) {
+      case 0: target &= operand; break;
+      case 1: target |= operand; break;
+      case 2: target ^= operand; break;
+      case 3: target = operand; break;
+    }
+  };
+
+  for (int i=0; i<4; ++i) {
+    const auto& operand = mods.frames[i];
+    if (mods.fields[i] & CGW_MOD_ID)
+      modify(frame.can_id, operand.can_id, i);
+    if (mods.fields[i] & CGW_MOD_LEN)
+      modify(frame.len, operand.len, i);
+    if (mods.fields[i] & CGW_MOD_DATA) {
+      for (int j=0; j<CANFD_MAX_DLEN; ++j)
+        modify(frame.data[j], operand.data[j], i);
+    }
+  }
+
+  // The kernel drops frames with a length that isn't valid for the frame type
+  return frame.len <= ((frame.flags & CANFD_FDF) ? CANFD_MAX_DLEN : CAN_MAX_DLEN);
+}
+
+
+void can::Kernel_gateway::open()
+{
+  if (fd_ != -1)
+    throw Kernel_gateway_error{"Already open"};
+
+  fd_ = ::socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+  if (fd_ == -1)
+    throw Kernel_gateway_error{"Could not open netlink socket"};
+}
+
+
+void can::Kernel_gateway::close()
+{
+  if (fd_ == -1)
+    return;
+
+  // Rules are matched by their attributes when deleted
+  for (auto& rule : rules_) {
+    reinterpret_cast<nlmsghdr*>(rule.data())->nlmsg_type = RTM_DELROUTE;
+    try {
+      request(rule);
+    }
+    catch (const Kernel_gateway_error&) {
+      // Already deleted, e.g. by the cangw tool of can-utils
+    }
+  }
+  rules_.clear();
+
+  ::close(fd_);
+  fd_ = -1;
+}
+
+
+void can::Kernel_gateway::add(int src_ifindex, int dst_ifindex, const can_filter* filter,
+    const Frame_mods& mods, bool fd)
+{
+  std::vector<std::uint8_t> msg(NLMSG_SPACE(sizeof(rtcanmsg)));
+  auto* hdr = reinterpret_cast<nlmsghdr*>(msg.data());
+  hdr->nlmsg_type = RTM_NEWROUTE;
+  hdr->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+
+  rtcanmsg rtcan;
+  std::memset(&rtcan, 0, sizeof(rtcan));
+  rtcan.can_family = AF_CAN;
+  rtcan.gwtype = CGW_TYPE_CAN_CAN;
+  rtcan.flags = fd ? CGW_FLAGS_CAN_FD : 0;
+  std::memcpy(NLMSG_DATA(hdr), &rtcan, sizeof(rtcan));
+
+  const std::uint32_t src = src_ifindex;
+  const std::uint32_t dst = dst_ifindex;
+  append_attribute(msg, CGW_SRC_IF, &src, sizeof(src));
+  append_attribute(msg, CGW_DST_IF, &dst, sizeof(dst));
+  if (filter)
+    append_attribute(msg, CGW_FILTER, filter, sizeof(*filter));
+
+  // Classic modifications use the can_frame layout, which matches the start of canfd_frame
+  for (int i=0; i<4; ++i) {
+    if (mods.fields[i] == 0)
+      continue;
+    if (fd) {
+      cgw_fdframe_mod mod;
+      std::memcpy(&mod.cf, &mods.frames[i], sizeof(mod.cf));
+      mod.modtype = mods.fields[i];
+      append_attribute(msg, CGW_FDMOD_AND + i, &mod, sizeof(mod));
+    }
+    else {
+      cgw_frame_mod mod;
+      std::memcpy(&mod.cf, &mods.frames[i], sizeof(mod.cf));
+      mod.modtype = mods.fields[i];
+      append_attribute(msg, CGW_MOD_AND + i, &mod, sizeof(mod));
+    }
+  }
+
+  request(msg);
+  rules_.push_back(std::move(msg));
+}
+
+
+void can::Kernel_gateway::request(std::vector<std::uint8_t>& msg)
+{
+  auto* hdr = reinterpret_cast<nlmsghdr*>(msg.data());
+  hdr->nlmsg_len = msg.size();
+  hdr->nlmsg_seq = ++sequence_;
+  if (::send(fd_, msg.data(), msg.size(), 0) != static_cast<ssize_t>(msg.size()))
+    throw Kernel_gateway_error{"Error sending netlink request"};
+
+  // Replies to other sequence numbers are stale acks of earlier requests
+  std::array<std::uint8_t, 4096> buffer;
+  while (true) {
+    auto n = ::recv(fd_, buffer.data(), buffer.size(), 0);
+    if (n < 0)
+      throw Kernel_gateway_error{"Error receiving netlink ack"};
+    for (auto* reply = reinterpret_cast<nlmsghdr*>(buffer.data()); NLMSG_OK(reply, n);
+         reply = NLMSG_NEXT(reply, n)) {
+      if (reply->nlmsg_seq != sequence_ || reply->nlmsg_type != NLMSG_ERROR)
+        continue;
+      const auto* ack = static_cast<const nlmsgerr*>(NLMSG_DATA(reply));
+      if (ack->error != 0) {
+        throw Kernel_gateway_error{std::string{"Kernel gateway rule rejected: "} +
+            std::strerror(-ack->error)};
+      }
+      return;
+    }
+  }
+}
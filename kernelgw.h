@@ -0,0 +1,77 @@
+/* Programs CAN to CAN routing rules of the kernel's can-gw module over netlink, frames routed by
+ * these rules never leave the kernel
+ */
+
+
+#ifndef CAN_KERNEL_GW_H
+#define CAN_KERNEL_GW_H
+
+
+#include <linux/can.h>
+
+#include <cstdint>
+#include <array>
+#include <vector>
+#include <string>
+#include <stdexcept>
+
+
+namespace can
+{
+
+
+class Kernel_gateway_error : public std::runtime_error
+{
+public:
+  Kernel_gateway_error(const std::string& s) : std::runtime_error{s} {}
+  Kernel_gateway_error(const char* s) : std::runtime_error{s} {}
+};
+
+
+// Frame modifications per function in the order applied by can-gw: AND, OR, XOR, SET
+struct Frame_mods
+{
+  std::array<canfd_frame, 4> frames{};  // Operand of each function
+  std::array<std::uint8_t, 4> fields{};  // CGW_MOD_ID, CGW_MOD_LEN and CGW_MOD_DATA mask
+};
+
+
+// Adds a modification in the format <and|or|xor|set>:<id|len|data>:<hex value>, data is a hex byte
+// string starting with the first byte
+void parse_frame_mod(const std::string& s, Frame_mods& mods);
+// Same result as can-gw, returns false if the modified length is invalid
+bool apply_frame_mods(const Frame_mods& mods, canfd_frame& frame);
+
+
+class Kernel_gateway
+{
+public:
+  Kernel_gateway() : fd_{-1} {}
+  ~Kernel_gateway() { close(); }
+
+  Kernel_gateway(const Kernel_gateway&) = delete;
+  Kernel_gateway& operator=(const Kernel_gateway&) = delete;
+  Kernel_gateway(Kernel_gateway&&) = delete;
+  Kernel_gateway& operator=(Kernel_gateway&&) = delete;
+
+  void open();
+  void close();  // Deletes the rules added by this gateway
+
+  // Routes frames received on src to dst, all frames if filter is null, requires CAP_NET_ADMIN
+  // and the can-gw module, FD rules route both classic and CAN FD frames
+  void add(int src_ifindex, int dst_ifindex, const can_filter* filter, const Frame_mods& mods,
+      bool fd);
+
+private:
+  void request(std::vector<std::uint8_t>& msg);  // Sends the message and waits for the ack
+
+  int fd_;
+  std::uint32_t sequence_{0};
+  std::vector<std::vector<std::uint8_t>> rules_;  // Messages of the added rules
+};
+
+
+}  // namespace can
+
+
+#endif  // CAN_KERNEL_GW_H
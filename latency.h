@@ -0,0 +1,70 @@
+/* A fixed bucket histogram of latencies in ns with 1 us resolution up to 10 ms, larger values are
+ * counted in an overflow bucket, recording never allocates
+ */
+
+
+#ifndef UTIL_LATENCY_H
+#define UTIL_LATENCY_H
+
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <algorithm>
+
+
+namespace util
+{
+
+
+class Latency_histogram
+{
+public:
+  static constexpr std::uint64_t resolution = 1000;  // Bucket width in ns
+  static constexpr std::size_t bucket_count = 10000;
+
+  void add(std::uint64_t ns)
+  {
+    auto bucket = std::min<std::uint64_t>(ns / resolution, bucket_count);
+    ++buckets_[bucket];
+    ++count_;
+    max_ = std::max(max_, ns);
+  }
+
+  // Upper bound of the bucket holding the p-th percentile (0..100), max if in the overflow bucket
+  std::uint64_t percentile(double p) const
+  {
+    if (count_ == 0)
+      return 0;
+    auto rank = static_cast<std::uint64_t>(p / 100.0 * count_ + 0.5);
+    rank = std::max<std::uint64_t>(rank, 1);
+    std::uint64_t seen = 0;
+    for (std::size_t i=0; i<bucket_count; ++i) {
+      seen += buckets_[i];
+      if (seen >= rank)
+        return std::min((i + 1) * resolution, max_);
+    }
+    return max_;
+  }
+
+  std::uint64_t max() const { return max_; }
+  std::uint64_t count() const { return count_; }
+
+  void clear()
+  {
+    buckets_.fill(0);
+    count_ = 0;
+    max_ = 0;
+  }
+
+private:
+  std::array<std::uint64_t, bucket_count + 1> buckets_{};  // Last one is the overflow bucket
+  std::uint64_t count_{0};
+  std::uint64_t max_{0};
+};
+
+
+}  // namespace util
+
+
+#endif  // UTIL_LATENCY_H
@@ -0,0 +1,140 @@
+#include "lz.h"
+
+
+#include <cstring>
+#include <array>
+
+
+namespace
+{
+
+
+constexpr std::size_t min_match = 4;
+constexpr int hash_bits = 12;
+
+
+std::uint32_t read32(const std::uint8_t* p)
+{
+  std::uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+
+std::uint32_t hash(std::uint32_t value) { return (value * 2654435761u) >> (32 - hash_bits); }
+
+
+std::uint8_t* put_count(std::uint8_t* out, std::size_t count)
+{
+  for (; count >= 255; count -= 255)
+    *out++ = 255;
+  *out++ = count;
+  return out;
+}
+
+
+std::uint8_t* put_literals(std::uint8_t* out, const std::uint8_t* literals, std::size_t count,
+    std::size_t match_length)
+{
+  auto* token = out++;
+  *token = (count < 15 ? count : 15) << 4;
+  if (match_length) {
+    auto length = match_length - min_match;
+    *token |= length < 15 ? length : 15;
+  }
+  if (count >= 15)
+    out = put_count(out, count - 15);
+  std::memcpy(out, literals, count);
+  return out + count;
+}
+
+
+// Returns false if the count runs past the end
+bool get_count(const std::uint8_t*& in, const std::uint8_t* end, std::size_t& count)
+{
+  std::uint8_t byte;
+  do {
+    if (in == end)
+      return false;
+    byte = *in++;
+    count += byte;
+  } while (byte == 255);
+  return true;
+}
+
+
+}  // namespace
+
+
+std::size_t util::lz_compress(const std::uint8_t* in, std::size_t size, std::uint8_t* out)
+{
+  // Positions of the last occurrence of each hashed 4-byte sequence
+  std::array<std::uint16_t, 1 << hash_bits> table{};
+  auto* begin = out;
+  std::size_t anchor = 0;  // Start of the pending literals
+  std::size_t pos = 0;
+
+  while (size >= min_match && pos <= size - min_match) {
+    auto value = read32(in + pos);
+    auto h = hash(value);
+    std::size_t candidate = table[h];
+    table[h] = pos;
+    if (candidate >= pos || read32(in + candidate) != value) {
+      ++pos;
+      continue;
+    }
+
+    auto length = min_match;
+    while (pos + length < size && in[candidate + length] == in[pos + length])
+      ++length;
+
+    out = put_literals(out, in + anchor, pos - anchor, length);
+    const std::uint16_t offset = pos - candidate;
+    *out++ = offset & 0xFF;
+    *out++ = offset >> 8;
+    if (length - min_match >= 15)
+      out = put_count(out, length - min_match - 15);
+    pos += length;
+    anchor = pos;
+  }
+
+  out = put_literals(out, in + anchor, size - anchor, 0);
+  return out - begin;
+}
+
+
+std::size_t util::lz_decompress(const std::uint8_t* in, std::size_t size, std::uint8_t* out,
+    std::size_t capacity)
+{
+  const auto* end = in + size;
+  std::size_t pos = 0;
+
+  while (in < end) {
+    auto token = *in++;
+    std::size_t count = token >> 4;
+    if (count == 15 && !get_count(in, end, count))
+      return 0;
+    if (count > static_cast<std::size_t>(end - in) || count > capacity - pos)
+      return 0;
+    std::memcpy(out + pos, in, count);
+    in += count;
+    pos += count;
+    if (in == end)
+      break;  // Last sequence
+
+    if (end - in < 2)
+      return 0;
+    std::size_t offset = in[0] | in[1] << 8;
+    in += 2;
+    std::size_t length = token & 0x0F;
+    if (length == 15 && !get_count(in, end, length))
+      return 0;
+    length += min_match;
+    if (offset == 0 || offset > pos || length > capacity - pos)
+      return 0;
+    // Byte by byte, matches may overlap the bytes they produce
+    for (std::size_t i=0; i<length; ++i, ++pos)
+      out[pos] = out[pos - offset];
+  }
+  return pos;
+}
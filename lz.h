@@ -0,0 +1,36 @@
+/* A fast byte oriented LZ77 block compressor for datagram sized blocks (< 64 KiB)
+ *
+ * A block is a sequence of a token byte (literal count << 4 | match length - 4), more literal
+ * count bytes if the count is 15 or above, the literals, a 2-byte little endian match offset and
+ * more match length bytes if the length is 19 or above. Counts continue with bytes of 255 until a
+ * byte below 255. The last sequence only has literals.
+ */
+
+
+#ifndef UTIL_LZ_H
+#define UTIL_LZ_H
+
+
+#include <cstdint>
+#include <cstddef>
+
+
+namespace util
+{
+
+
+// Output size for incompressible input
+constexpr std::size_t lz_bound(std::size_t size) { return size + size / 255 + 16; }
+
+// Returns the compressed size, out must hold lz_bound(size) bytes, size must be below 64 KiB
+std::size_t lz_compress(const std::uint8_t* in, std::size_t size, std::uint8_t* out);
+
+// Returns the decompressed size, 0 if the block is invalid or doesn't fit into capacity
+std::size_t lz_decompress(const std::uint8_t* in, std::size_t size, std::uint8_t* out,
+    std::size_t capacity);
+
+
+}  // namespace util
+
+
+#endif  // UTIL_LZ_H
@@ -0,0 +1,374 @@
+#include "matchfilter.h"
+
+
+#include <linux/can.h>
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <cctype>
+#include <memory>
+#include <utility>
+
+
+namespace
+{
+
+
+enum class Term { id, len, data, ext, rtr, fd };
+enum class Comparison { none, eq, ne, lt, le, gt, ge };
+
+
+struct Node
+{
+  enum class Type { match, negation, conjunction, disjunction };
+
+  Type type;
+  Term term;  // Match only
+  std::uint32_t index;  // Byte of data terms
+  std::uint32_t mask;  // All bits if not masked
+  Comparison comparison;
+  std::uint32_t value;
+  std::unique_ptr<Node> left;  // Operands of the logical operators
+  std::unique_ptr<Node> right;
+};
+
+
+std::unique_ptr<Node> make_node(Node::Type type, std::unique_ptr<Node> left,
+    std::unique_ptr<Node> right = nullptr)
+{
+  auto node = std::make_unique<Node>();
+  node->type = type;
+  node->left = std::move(left);
+  node->right = std::move(right);
+  return node;
+}
+
+
+// Recursive descent parser, precedence from low to high: ||, &&, !, match
+class Parser
+{
+public:
+  explicit Parser(const std::string& expression) : s_(expression) {}
+
+  std::unique_ptr<Node> parse()
+  {
+    auto node = disjunction();
+    skip_space();
+    if (pos_ != s_.size())
+      error("Unexpected character");
+    return node;
+  }
+
+  bool uses_id() const { return uses_id_; }
+
+private:
+  std::unique_ptr<Node> disjunction()
+  {
+    auto node = conjunction();
+    while (accept("||"))
+      node = make_node(Node::Type::disjunction, std::move(node), conjunction());
+    return node;
+  }
+
+  std::unique_ptr<Node> conjunction()
+  {
+    auto node = unary();
+    while (accept("&&"))
+      node = make_node(Node::Type::conjunction, std::move(node), unary());
+    return node;
+  }
+
+  std::unique_ptr<Node> unary()
+  {
+    if (accept("!"))
+      return make_node(Node::Type::negation, unary());
+    if (accept("(")) {
+      auto node = disjunction();
+      if (!accept(")"))
+        error("Missing )");
+      return node;
+    }
+    return match();
+  }
+
+  std::unique_ptr<Node> match()
+  {
+    auto node = std::make_unique<Node>();
+    node->type = Node::Type::match;
+    node->index = 0;
+    node->mask = 0xFFFFFFFF;
+    node->comparison = Comparison::none;
+    node->value = 0;
+
+    auto name = identifier();
+    if (name == "id")
+      node->term = Term::id;
+    else if (name == "len")
+      node->term = Term::len;
+    else if (name == "data")
+      node->term = Term::data;
+    else if (name == "ext")
+      node->term = Term::ext;
+    else if (name == "rtr")
+      node->term = Term::rtr;
+    else if (name == "fd")
+      node->term = Term::fd;
+    else
+      error("Unknown term " + name);
+    uses_id_ = uses_id_ || node->term == Term::id || node->term == Term::ext ||
+        node->term == Term::rtr;
+
+    if (node->term == Term::data) {
+      if (!accept("["))
+        error("Missing [");
+      node->index = number();
+      if (node->index >= CANFD_MAX_DLEN)
+        error("Data index out of range");
+      if (!accept("]"))
+        error("Missing ]");
+    }
+
+    // A single & is a mask, && ends the match
+    skip_space();
+    const bool flag = node->term == Term::ext || node->term == Term::rtr ||
+        node->term == Term::fd;
+    if (s_.compare(pos_, 1, "&") == 0 && s_.compare(pos_, 2, "&&") != 0) {
+      ++pos_;
+      node->mask = number();
+    }
+    static const std::pair<const char*, Comparison> comparisons[] = {
+      {"==", Comparison::eq}, {"!=", Comparison::ne}, {"<=", Comparison::le},
+      {">=", Comparison::ge}, {"<", Comparison::lt}, {">", Comparison::gt}
+    };
+    for (const auto& comparison : comparisons) {
+      if (accept(comparison.first)) {
+        node->comparison = comparison.second;
+        node->value = number();
+        break;
+      }
+    }
+    if (flag && (node->mask != 0xFFFFFFFF || node->comparison != Comparison::none))
+      error("ext, rtr and fd can't be masked or compared, use !");
+    return node;
+  }
+
+  std::string identifier()
+  {
+    skip_space();
+    auto start = pos_;
+    while (pos_ < s_.size() && std::isalpha(static_cast<unsigned char>(s_[pos_])))
+      ++pos_;
+    if (start == pos_)
+      error("Expected a term");
+    return s_.substr(start, pos_ - start);
+  }
+
+  std::uint32_t number()
+  {
+    skip_space();
+    const bool hex = s_.compare(pos_, 2, "0x") == 0 || s_.compare(pos_, 2, "0X") == 0;
+    const char* start = s_.c_str() + pos_;
+    char* end = nullptr;
+    auto value = std::strtoull(start, &end, hex ? 16 : 10);
+    if (end == start || (hex && end == start + 2) || !std::isxdigit(static_cast<unsigned char>(
+        *start)) || value > 0xFFFFFFFF)
+      error("Expected a number");
+    pos_ += end - start;
+    return value;
+  }
+
+  bool accept(const char* token)
+  {
+    skip_space();
+    const std::string t{token};
+    if (s_.compare(pos_, t.size(), t) != 0)
+      return false;
+    pos_ += t.size();
+    return true;
+  }
+
+  void skip_space()
+  {
+    while (pos_ < s_.size() && std::isspace(static_cast<unsigned char>(s_[pos_])))
+      ++pos_;
+  }
+
+  [[noreturn]] void error(const std::string& what)
+  {
+    throw can::Match_error{what + " at position " + std::to_string(pos_) + " in " + s_};
+  }
+
+  const std::string& s_;
+  std::size_t pos_{0};
+  bool uses_id_{false};
+};
+
+
+// Emits branches to symbolic labels, jump offsets are resolved once all labels are placed
+class Generator
+{
+public:
+  static constexpr int next = -1;  // Continue with the following instruction
+
+  int label()
+  {
+    labels_.push_back(-1);
+    return labels_.size() - 1;
+  }
+
+  void place(int label) { labels_[label] = code_.size(); }
+
+  void emit(std::uint16_t code, std::uint32_t k, int on_true = next, int on_false = next)
+  {
+    code_.push_back(Instruction{sock_filter{code, 0, 0, k}, on_true, on_false});
+  }
+
+  void load_id()
+  {
+    // Loads are big endian, the ID is assembled from single bytes on little endian hosts
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    emit(BPF_LD | BPF_B | BPF_ABS, 0);
+    for (std::uint32_t i=1; i<4; ++i) {
+      emit(BPF_MISC | BPF_TAX, 0);
+      emit(BPF_LD | BPF_B | BPF_ABS, i);
+      emit(BPF_ALU | BPF_LSH | BPF_K, i * 8);
+      emit(BPF_ALU | BPF_OR | BPF_X, 0);
+    }
+#else
+    emit(BPF_LD | BPF_W | BPF_ABS, 0);
+#endif
+    emit(BPF_ST, 0);  // Kept in M[0] for all terms using the ID
+  }
+
+  void branch(const Node& node, int on_true, int on_false)
+  {
+    switch (node.type) {
+      case Node::Type::negation:
+        branch(*node.left, on_false, on_true);
+        return;
+      case Node::Type::conjunction: {
+        auto right = label();
+        branch(*node.left, right, on_false);
+        place(right);
+        branch(*node.right, on_true, on_false);
+        return;
+      }
+      case Node::Type::disjunction: {
+        auto right = label();
+        branch(*node.left, on_true, right);
+        place(right);
+        branch(*node.right, on_true, on_false);
+        return;
+      }
+      case Node::Type::match:
+        match(node, on_true, on_false);
+        return;
+    }
+  }
+
+  std::vector<sock_filter> resolve() const
+  {
+    if (code_.size() > BPF_MAXINSNS)
+      throw can::Match_error{"Expression too long"};
+    std::vector<sock_filter> program;
+    for (std::size_t i=0; i<code_.size(); ++i) {
+      auto instruction = code_[i].code;
+      instruction.jt = offset(code_[i].on_true, i);
+      instruction.jf = offset(code_[i].on_false, i);
+      program.push_back(instruction);
+    }
+    return program;
+  }
+
+private:
+  struct Instruction
+  {
+    sock_filter code;
+    int on_true;  // Labels of conditional jumps
+    int on_false;
+  };
+
+  void match(const Node& node, int on_true, int on_false)
+  {
+    switch (node.term) {
+      case Term::id:
+        emit(BPF_LD | BPF_MEM, 0);
+        emit(BPF_ALU | BPF_AND | BPF_K, CAN_EFF_MASK);
+        break;
+      case Term::len:
+        emit(BPF_LD | BPF_B | BPF_ABS, offsetof(canfd_frame, len));
+        break;
+      case Term::data:
+        if (node.index >= CAN_MAX_DLEN) {
+          // Loads beyond the frame would end the program and drop the frame
+          emit(BPF_LD | BPF_W | BPF_LEN, 0);
+          emit(BPF_JMP | BPF_JEQ | BPF_K, CANFD_MTU, next, on_false);
+        }
+        emit(BPF_LD | BPF_B | BPF_ABS, offsetof(canfd_frame, data) + node.index);
+        break;
+      case Term::ext:
+      case Term::rtr:
+        emit(BPF_LD | BPF_MEM, 0);
+        emit(BPF_JMP | BPF_JSET | BPF_K, node.term == Term::ext ? CAN_EFF_FLAG : CAN_RTR_FLAG,
+            on_true, on_false);
+        return;
+      case Term::fd:
+        emit(BPF_LD | BPF_W | BPF_LEN, 0);
+        emit(BPF_JMP | BPF_JEQ | BPF_K, CANFD_MTU, on_true, on_false);
+        return;
+    }
+
+    if (node.comparison == Comparison::none) {
+      emit(BPF_JMP | BPF_JSET | BPF_K, node.mask, on_true, on_false);
+      return;
+    }
+    if (node.mask != 0xFFFFFFFF)
+      emit(BPF_ALU | BPF_AND | BPF_K, node.mask);
+    switch (node.comparison) {
+      case Comparison::eq: emit(BPF_JMP | BPF_JEQ | BPF_K, node.value, on_true, on_false); break;
+      case Comparison::ne: emit(BPF_JMP | BPF_JEQ | BPF_K, node.value, on_false, on_true); break;
+      case Comparison::gt: emit(BPF_JMP | BPF_JGT | BPF_K, node.value, on_true, on_false); break;
+      case Comparison::ge: emit(BPF_JMP | BPF_JGE | BPF_K, node.value, on_true, on_false); break;
+      case Comparison::lt: emit(BPF_JMP | BPF_JGE | BPF_K, node.value, on_false, on_true); break;
+      case Comparison::le: emit(BPF_JMP | BPF_JGT | BPF_K, node.value, on_false, on_true); break;
+      case Comparison::none: break;
+    }
+  }
+
+  std::uint8_t offset(int label, std::size_t from) const
+  {
+    // Conditional jumps only reach 255 instructions ahead
+    if (label == next)
+      return 0;
+    auto offset = labels_[label] - static_cast<int>(from) - 1;
+    if (offset < 0 || offset > 255)
+      throw can::Match_error{"Expression too long"};
+    return offset;
+  }
+
+  std::vector<Instruction> code_;
+  std::vector<int> labels_;  // Instruction index of each label
+};
+
+
+}  // namespace
+
+
+std::vector<sock_filter> can::compile_match(const std::string& expression)
+{
+  Parser parser{expression};
+  auto root = parser.parse();
+
+  Generator generator;
+  auto accept = generator.label();
+  auto drop = generator.label();
+  if (parser.uses_id())
+    generator.load_id();
+  generator.branch(*root, accept, drop);
+  generator.place(accept);
+  generator.emit(BPF_RET | BPF_K, 0xFFFFFFFF);
+  generator.place(drop);
+  generator.emit(BPF_RET | BPF_K, 0);
+  return generator.resolve();
+}
@@ -0,0 +1,46 @@
+/* Compiles frame match expressions into classic BPF programs, attached to a socket with
+ * SO_ATTACH_FILTER the kernel drops frames that don't match before they are copied to user space
+ *
+ *   id==0x1F6 && data[0]&0x01
+ *   id&0x700==0x100 || !(ext || rtr)
+ *
+ * terms: id (without flags), len, data[0] to data[63], ext, rtr and fd
+ * operators: a mask with & (applied before comparing), comparisons ==, !=, <, <=, >, >=, then !,
+ * && and || with the usual precedence
+ *
+ * A term without comparison is true if it is not 0. Numbers are decimal or hex with 0x. Payload
+ * bytes beyond the first 8 are false for classic frames.
+ */
+
+
+#ifndef CAN_MATCH_FILTER_H
+#define CAN_MATCH_FILTER_H
+
+
+#include <linux/filter.h>
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+
+namespace can
+{
+
+
+class Match_error : public std::runtime_error
+{
+public:
+  Match_error(const std::string& s) : std::runtime_error{s} {}
+  Match_error(const char* s) : std::runtime_error{s} {}
+};
+
+
+// The program expects the CAN frame at offset 0, as received by raw and packet sockets
+std::vector<sock_filter> compile_match(const std::string& expression);
+
+
+}  // namespace can
+
+
+#endif  // CAN_MATCH_FILTER_H
@@ -0,0 +1,249 @@
+#include "packetring.h"
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
+
+#include <cstring>
+#include <iterator>
+
+
+namespace
+{
+
+
+class Scope_guard
+{
+public:
+  Scope_guard(int fd) : fd_{fd} {}
+  ~Scope_guard() { if (fd_ != -1) ::close(fd_); fd_ = -1; }
+  Scope_guard(const Scope_guard&) = delete;
+  Scope_guard& operator=(const Scope_guard&) = delete;
+  void release() { fd_  = -1; }
+
+private:
+  int fd_;
+};
+
+
+// Accepts received and looped back CAN and CAN FD frames, drops copies of outgoing frames and all
+// other protocols when bound to all interfaces, a match program may follow instead of the accept
+const sock_filter can_protocol_filter[] = {
+  {BPF_LD | BPF_W | BPF_ABS, 0, 0, static_cast<__u32>(SKF_AD_OFF + SKF_AD_PKTTYPE)},
+  {BPF_JMP | BPF_JEQ | BPF_K, 0, 1, PACKET_OUTGOING},
+  {BPF_RET | BPF_K, 0, 0, 0},
+  {BPF_LD | BPF_H | BPF_ABS, 0, 0, static_cast<__u32>(SKF_AD_OFF + SKF_AD_PROTOCOL)},
+  {BPF_JMP | BPF_JEQ | BPF_K, 2, 0, ETH_P_CAN},
+  {BPF_JMP | BPF_JEQ | BPF_K, 1, 0, ETH_P_CANFD},
+  {BPF_RET | BPF_K, 0, 0, 0},
+  {BPF_RET | BPF_K, 0, 0, 0xFFFFFFFF}
+};
+
+
+}  // namespace
+
+
+void can::Packet_ring::open(int ifindex, std::size_t block_size, int block_count,
+    std::chrono::milliseconds timeout)
+{
+  if (fd_ != -1)
+    throw Packet_ring_error{"Already open"};
+  if (block_size == 0 || block_size % sysconf(_SC_PAGESIZE) != 0 || block_count <= 0)
+    throw Packet_ring_error{"Block size must be a multiple of the page size"};
+
+  // Protocol 0 receives nothing until bound, the filter is in place before the first frame
+  fd_ = ::socket(PF_PACKET, SOCK_RAW, 0);
+  if (fd_ == -1)
+    throw Packet_ring_error{"Could not open packet socket, forgot sudo?"};
+
+  Scope_guard guard{fd_};
+
+  attach_filter();
+
+  const int version = TPACKET_V3;
+  if (setsockopt(fd_, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0)
+    throw Packet_ring_error{"Error setting packet version, kernel too old?"};
+
+  tpacket_req3 req;
+  std::memset(&req, 0, sizeof(req));
+  req.tp_block_size = block_size;
+  req.tp_block_nr = block_count;
+  req.tp_frame_size = TPACKET_ALIGN(TPACKET3_HDRLEN + sizeof(canfd_frame));  // Unused by V3
+  req.tp_frame_nr = block_size / req.tp_frame_size * block_count;
+  req.tp_retire_blk_tov = timeout.count();
+  if (setsockopt(fd_, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0)
+    throw Packet_ring_error{"Error setting up receive ring"};
+
+  auto* ring = mmap(nullptr, block_size * block_count, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_LOCKED, fd_, 0);
+  if (ring == MAP_FAILED)
+    throw Packet_ring_error{"Error mapping receive ring"};
+  ring_ = static_cast<std::uint8_t*>(ring);
+  block_size_ = block_size;
+  block_count_ = block_count;
+
+  sockaddr_ll addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(ETH_P_ALL);
+  addr.sll_ifindex = ifindex;
+  if (::bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+    munmap(ring_, block_size_ * block_count_);
+    ring_ = nullptr;
+    throw Packet_ring_error{"Error while binding packet socket"};
+  }
+
+  guard.release();
+  if (hardware_time_)
+    set_hardware_timestamp(true);
+}
+
+
+void can::Packet_ring::close()
+{
+  if (ring_)
+    munmap(ring_, block_size_ * block_count_);
+  if (fd_ != -1)
+    ::close(fd_);
+
+  fd_ = -1;
+  ring_ = nullptr;
+  block_ = 0;
+  packets_left_ = 0;
+  packet_ = nullptr;
+}
+
+
+void can::Packet_ring::set_filters(const std::vector<can_filter>& filters, bool join)
+{
+  filters_ = filters;
+  join_filters_ = join;
+  filtering_ = true;
+}
+
+
+void can::Packet_ring::set_filter_program(const std::vector<sock_filter>& program)
+{
+  program_ = program;
+  if (fd_ != -1)
+    attach_filter();  // Replaces the attached program atomically
+}
+
+
+void can::Packet_ring::set_hardware_timestamp(bool enable)
+{
+  // Raw hardware time where the driver offers it, software time otherwise
+  hardware_time_ = enable;
+  if (fd_ == -1)
+    return;  // Applied when opened
+  const int param = enable ? SOF_TIMESTAMPING_RAW_HARDWARE : 0;
+  if (setsockopt(fd_, SOL_PACKET, PACKET_TIMESTAMP, &param, sizeof(param)) != 0)
+    throw Packet_ring_error{"Error setting packet timestamp"};
+}
+
+
+int can::Packet_ring::receive_batch(canfd_frame* frames, std::uint64_t* times, int count,
+    int* ifindices)
+{
+  int received = 0;
+  while (received < count) {
+    if (packets_left_ == 0) {
+      auto* block = reinterpret_cast<tpacket_block_desc*>(ring_ + block_ * block_size_);
+      auto status = __atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE);
+      if ((status & TP_STATUS_USER) == 0)
+        break;  // Block still owned by the kernel
+      if (status & TP_STATUS_LOSING) {
+        // Reading the statistics resets them
+        tpacket_stats_v3 stats;
+        socklen_t len = sizeof(stats);
+        if (getsockopt(fd_, SOL_PACKET, PACKET_STATISTICS, &stats, &len) == 0)
+          drops_ += stats.tp_drops;
+      }
+      packets_left_ = block->hdr.bh1.num_pkts;
+      packet_ = reinterpret_cast<std::uint8_t*>(block) + block->hdr.bh1.offset_to_first_pkt;
+      if (packets_left_ == 0) {
+        release_block();
+        continue;
+      }
+    }
+
+    const auto* hdr = reinterpret_cast<const tpacket3_hdr*>(packet_);
+    const auto* addr = reinterpret_cast<const sockaddr_ll*>(packet_ +
+        TPACKET_ALIGN(sizeof(tpacket3_hdr)));
+    const auto* data = packet_ + hdr->tp_mac;
+    const bool fd_frame = ntohs(addr->sll_protocol) == ETH_P_CANFD;
+
+    auto& frame = frames[received];
+    if (hdr->tp_snaplen == (fd_frame ? CANFD_MTU : CAN_MTU) && (!fd_frame || fd_frames_)) {
+      std::memcpy(&frame, data, hdr->tp_snaplen);
+      if (fd_frame)
+        frame.flags |= CANFD_FDF;
+      else
+        frame.flags &= ~CANFD_FDF;
+      // Error frames are not received by raw sockets unless requested, neither are they here
+      if (!(frame.can_id & CAN_ERR_FLAG) && matches(frame.can_id)) {
+        if (times)
+          times[received] = hdr->tp_sec * 1'000'000'000ull + hdr->tp_nsec;
+        if (ifindices)
+          ifindices[received] = addr->sll_ifindex;
+        ++received;
+      }
+    }
+
+    packet_ += hdr->tp_next_offset;
+    if (--packets_left_ == 0)
+      release_block();
+  }
+
+  return received;
+}
+
+
+void can::Packet_ring::attach_filter()
+{
+  std::vector<sock_filter> filter(std::begin(can_protocol_filter), std::end(can_protocol_filter));
+  if (!program_.empty()) {
+    filter.pop_back();
+    filter.insert(filter.end(), program_.begin(), program_.end());
+  }
+
+  sock_fprog program;
+  program.len = filter.size();
+  program.filter = filter.data();
+  if (setsockopt(fd_, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) != 0)
+    throw Packet_ring_error{"Error attaching protocol filter"};
+}
+
+
+bool can::Packet_ring::matches(canid_t id) const
+{
+  // Same rules as CAN_RAW_FILTER and CAN_RAW_JOIN_FILTERS
+  if (!filtering_)
+    return true;
+  for (const auto& filter : filters_) {
+    const bool inverted = filter.can_id & CAN_INV_FILTER;
+    const bool match = ((id & filter.can_mask) == (filter.can_id & ~CAN_INV_FILTER &
+        filter.can_mask)) != inverted;
+    if (match && !join_filters_)
+      return true;
+    if (!match && join_filters_)
+      return false;
+  }
+  return join_filters_ && !filters_.empty();
+}
+
+
+void can::Packet_ring::release_block()
+{
+  auto* block = reinterpret_cast<tpacket_block_desc*>(ring_ + block_ * block_size_);
+  __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+  block_ = (block_ + 1) % block_count_;
+}
@@ -0,0 +1,87 @@
+/* Receives CAN frames from a memory mapped PF_PACKET ring (TPACKET_V3) shared with the kernel,
+ * frames and their timestamps are read from the ring blocks without a copy per syscall
+ */
+
+
+#ifndef CAN_PACKET_RING_H
+#define CAN_PACKET_RING_H
+
+
+#include <linux/can.h>
+#include <linux/filter.h>
+
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <stdexcept>
+
+
+namespace can
+{
+
+
+class Packet_ring_error : public std::runtime_error
+{
+public:
+  Packet_ring_error(const std::string& s) : std::runtime_error{s} {}
+  Packet_ring_error(const char* s) : std::runtime_error{s} {}
+};
+
+
+class Packet_ring
+{
+public:
+  Packet_ring() : fd_{-1} {}
+  ~Packet_ring() { close(); }
+
+  Packet_ring(const Packet_ring&) = delete;
+  Packet_ring& operator=(const Packet_ring&) = delete;
+  Packet_ring(Packet_ring&&) = delete;
+  Packet_ring& operator=(Packet_ring&&) = delete;
+
+  // Block size must be a multiple of the page size, a block is handed to user space when full or
+  // after the timeout, interface index 0 receives from all CAN interfaces
+  void open(int ifindex, std::size_t block_size, int block_count,
+      std::chrono::milliseconds timeout);
+  void close();
+  int fd() const { return fd_; }  // Readable when a block was retired by the kernel
+
+  // Same semantics as the raw socket options, frames are filtered in user space
+  void set_fd_frames(bool enable) { fd_frames_ = enable; }
+  void set_filters(const std::vector<can_filter>& filters, bool join);
+  void set_filter_program(const std::vector<sock_filter>& program);  // Runs in the kernel
+  void set_hardware_timestamp(bool enable);
+
+  // Non-blocking, returns the count of frames copied out of the ring
+  int receive_batch(canfd_frame* frames, std::uint64_t* times, int count, int* ifindices);
+  std::uint32_t drops() const { return drops_; }
+
+private:
+  void attach_filter();
+  bool matches(canid_t id) const;
+  void release_block();
+
+  int fd_;
+  std::uint8_t* ring_{nullptr};
+  std::size_t block_size_{0};
+  int block_count_{0};
+  int block_{0};  // Block currently read
+  std::uint32_t packets_left_{0};  // Packets of the current block not read yet
+  std::uint8_t* packet_{nullptr};  // Next packet of the current block
+  bool fd_frames_{false};
+  bool hardware_time_{false};
+  bool filtering_{false};  // All frames are received until filters are set
+  std::vector<can_filter> filters_;
+  bool join_filters_{false};
+  std::vector<sock_filter> program_;  // Appended to the protocol filter
+  std::atomic<std::uint32_t> drops_{0};
+};
+
+
+}  // namespace can
+
+
+#endif  // CAN_PACKET_RING_H
@@ -1,4 +1,4 @@
-/* Functions for handling POSIX thread scheduling policy/priority
+/* Functions for handling POSIX thread scheduling policy/priority and CPU affinity
  */
 
 
@@ -44,6 +44,33 @@ inline int current_priority(std::thread::native_handle_type handle)
 }
 
 
+// Pins the thread to a single CPU, e.g. a core isolated with isolcpus
+inline bool set_affinity(std::thread::native_handle_type handle, int cpu)
+{
+  if (cpu < 0 || cpu >= CPU_SETSIZE)
+    return false;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(handle, sizeof(set), &set) == 0;
+}
+
+
+// Returns the CPU if the thread is pinned to exactly one, -1 otherwise
+inline int affinity(std::thread::native_handle_type handle)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (pthread_getaffinity_np(handle, sizeof(set), &set) != 0 || CPU_COUNT(&set) != 1)
+    return -1;
+  for (int cpu=0; cpu<CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &set))
+      return cpu;
+  }
+  return -1;
+}
+
+
 }  // namespace priority
 
 
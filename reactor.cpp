@@ -0,0 +1,197 @@
+#include "reactor.h"
+
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <array>
+
+
+void event::Reactor::open()
+{
+  if (epoll_fd_ != -1)
+    throw Reactor_error{"Already open"};
+
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ == -1)
+    throw Reactor_error{"Could not create epoll instance"};
+
+  wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (wake_fd_ == -1) {
+    close();
+    throw Reactor_error{"Could not create eventfd"};
+  }
+
+  epoll_event ev{};
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr;  // Marks the wakeup event
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev) != 0) {
+    close();
+    throw Reactor_error{"Could not register eventfd"};
+  }
+
+  stop_.store(false);
+}
+
+
+void event::Reactor::close()
+{
+  if (wake_fd_ != -1)
+    ::close(wake_fd_);
+  if (epoll_fd_ != -1)
+    ::close(epoll_fd_);
+  wake_fd_ = -1;
+  epoll_fd_ = -1;
+  handlers_.clear();
+}
+
+
+void event::Reactor::add(int fd, std::uint32_t events, Handler handler)
+{
+  auto h = std::make_unique<Handler>(std::move(handler));
+  epoll_event ev{};
+  ev.events = events;
+  ev.data.ptr = h.get();
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) != 0)
+    throw Reactor_error{"Could not register file descriptor"};
+  handlers_[fd] = std::move(h);
+}
+
+
+void event::Reactor::remove(int fd)
+{
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+  handlers_.erase(fd);
+}
+
+
+void event::Reactor::run()
+{
+  while (!stop_.load())
+    dispatch(-1);
+}
+
+
+void event::Reactor::spin(const std::function<void()>& poll)
+{
+  while (!stop_.load()) {
+    poll();
+    dispatch(0);
+  }
+}
+
+
+void event::Reactor::dispatch(int timeout)
+{
+  std::array<epoll_event, 16> events;
+  auto n = epoll_wait(epoll_fd_, events.data(), events.size(), timeout);
+  if (n == -1) {
+    if (errno == EINTR)
+      return;
+    throw Reactor_error{"Error while waiting for events"};
+  }
+  for (int i=0; i<n && !stop_.load(); ++i) {
+    if (auto* handler = static_cast<Handler*>(events[i].data.ptr))
+      (*handler)(events[i].events);
+  }
+}
+
+
+void event::Reactor::stop()
+{
+  stop_.store(true);
+  const std::uint64_t value = 1;
+  if (write(wake_fd_, &value, sizeof(value)) != sizeof(value)) {
+    // Counter overflow only, the reactor is woken up already
+  }
+}
+
+
+void event::Timer::open()
+{
+  if (fd_ != -1)
+    throw Reactor_error{"Already open"};
+
+  fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (fd_ == -1)
+    throw Reactor_error{"Could not create timerfd"};
+}
+
+
+void event::Timer::close()
+{
+  if (fd_ != -1)
+    ::close(fd_);
+  fd_ = -1;
+  armed_ = false;
+}
+
+
+void event::Timer::arm(std::chrono::microseconds timeout)
+{
+  if (timeout.count() <= 0)
+    timeout = std::chrono::microseconds{1};  // Zero would disarm
+
+  itimerspec spec{};
+  spec.it_value.tv_sec = timeout.count() / 1'000'000;
+  spec.it_value.tv_nsec = timeout.count() % 1'000'000 * 1000;
+  if (timerfd_settime(fd_, 0, &spec, nullptr) != 0)
+    throw Reactor_error{"Error arming timer"};
+  armed_ = true;
+}
+
+
+void event::Timer::disarm()
+{
+  itimerspec spec{};
+  timerfd_settime(fd_, 0, &spec, nullptr);
+  armed_ = false;
+}
+
+
+void event::Timer::clear()
+{
+  std::uint64_t expirations;
+  if (read(fd_, &expirations, sizeof(expirations)) == sizeof(expirations))
+    armed_ = false;
+}
+
+
+void event::Notifier::open()
+{
+  if (fd_ != -1)
+    throw Reactor_error{"Already open"};
+
+  fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (fd_ == -1)
+    throw Reactor_error{"Could not create eventfd"};
+}
+
+
+void event::Notifier::close()
+{
+  if (fd_ != -1)
+    ::close(fd_);
+  fd_ = -1;
+}
+
+
+void event::Notifier::notify()
+{
+  const std::uint64_t value = 1;
+  if (write(fd_, &value, sizeof(value)) != sizeof(value)) {
+    // Counter overflow only, the fd is readable already
+  }
+}
+
+
+void event::Notifier::clear()
+{
+  std::uint64_t value;
+  if (read(fd_, &value, sizeof(value)) != sizeof(value)) {
+    // Not readable, nothing to clear
+  }
+}
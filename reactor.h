@@ -0,0 +1,120 @@
+/* A small epoll event loop for servicing multiple sockets from a single thread
+ */
+
+
+#ifndef EVENT_REACTOR_H
+#define EVENT_REACTOR_H
+
+
+#include <cstdint>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+#include <functional>
+#include <string>
+#include <stdexcept>
+
+
+namespace event
+{
+
+
+class Reactor_error : public std::runtime_error
+{
+public:
+  Reactor_error(const std::string& s) : std::runtime_error{s} {}
+  Reactor_error(const char* s) : std::runtime_error{s} {}
+};
+
+
+class Reactor
+{
+public:
+  using Handler = std::function<void(std::uint32_t events)>;
+
+  Reactor() : epoll_fd_{-1}, wake_fd_{-1}, stop_{false} {}
+  ~Reactor() { close(); }
+
+  Reactor(const Reactor&) = delete;
+  Reactor& operator=(const Reactor&) = delete;
+  Reactor(Reactor&&) = delete;
+  Reactor& operator=(Reactor&&) = delete;
+
+  void open();
+  void close();
+
+  // Handlers are called from the thread running the reactor, events is an EPOLLIN etc. mask
+  void add(int fd, std::uint32_t events, Handler handler);
+  void remove(int fd);
+
+  void run();  // Dispatches events until stop is called
+  // Calls poll in a busy loop and dispatches ready events in between without sleeping
+  void spin(const std::function<void()>& poll);
+  void stop();  // Thread-safe, wakes up the reactor immediately
+
+private:
+  void dispatch(int timeout);  // Timeout in ms, -1 waits for the next event
+
+  int epoll_fd_;
+  int wake_fd_;  // eventfd for stop requests from other threads
+  std::atomic<bool> stop_;
+  std::unordered_map<int, std::unique_ptr<Handler>> handlers_;
+};
+
+
+class Timer
+{
+public:
+  Timer() : fd_{-1} {}
+  ~Timer() { close(); }
+
+  Timer(const Timer&) = delete;
+  Timer& operator=(const Timer&) = delete;
+  Timer(Timer&&) = delete;
+  Timer& operator=(Timer&&) = delete;
+
+  void open();
+  void close();
+
+  void arm(std::chrono::microseconds timeout);  // One-shot, re-arming replaces the timeout
+  void disarm();
+  bool armed() const { return armed_; }
+  void clear();  // Must be called by the handler to reset readiness
+
+  int fd() const { return fd_; }
+
+private:
+  int fd_;
+  bool armed_{false};
+};
+
+
+class Notifier
+{
+public:
+  Notifier() : fd_{-1} {}
+  ~Notifier() { close(); }
+
+  Notifier(const Notifier&) = delete;
+  Notifier& operator=(const Notifier&) = delete;
+  Notifier(Notifier&&) = delete;
+  Notifier& operator=(Notifier&&) = delete;
+
+  void open();
+  void close();
+
+  void notify();  // Thread-safe, makes fd readable
+  void clear();  // Must be called by the handler to reset readiness
+
+  int fd() const { return fd_; }
+
+private:
+  int fd_;
+};
+
+
+}  // namespace event
+
+
+#endif  // EVENT_REACTOR_H
@@ -0,0 +1,101 @@
+/* A lock-free single-producer/single-consumer ring buffer
+ *
+ * Head and tail live on separate cache lines, and each side keeps a cached copy of the other
+ * side's index, so the shared lines are only touched when the cached view runs out. The ring
+ * must not be allocated with plain new before C++17, the over-aligned members require aligned
+ * storage, e.g. a local or static object.
+ */
+
+
+#ifndef UTIL_RING_H
+#define UTIL_RING_H
+
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <vector>
+
+
+namespace util
+{
+
+
+constexpr std::size_t cache_line_size = 64;
+
+
+template<typename T>
+class Spsc_ring
+{
+public:
+  explicit Spsc_ring(std::size_t capacity) : buffer_(round_up(capacity)), mask_{buffer_.size() - 1}
+  {
+  }
+
+  Spsc_ring(const Spsc_ring&) = delete;
+  Spsc_ring& operator=(const Spsc_ring&) = delete;
+
+  // Producer side, returns number of values pushed, the rest is counted as overflow
+  std::size_t push(const T* values, std::size_t count)
+  {
+    const auto head = head_.load(std::memory_order_relaxed);
+    if (head - cached_tail_ + count > buffer_.size())
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+    auto free = buffer_.size() - (head - cached_tail_);
+    auto n = count < free ? count : free;
+    for (std::size_t i=0; i<n; ++i)
+      buffer_[(head + i) & mask_] = values[i];
+    head_.store(head + n, std::memory_order_release);
+    if (n < count)
+      overflows_.store(overflows_.load(std::memory_order_relaxed) + count - n,
+          std::memory_order_relaxed);
+    return n;
+  }
+
+  // Consumer side, returns number of values popped
+  std::size_t pop(T* values, std::size_t max)
+  {
+    const auto tail = tail_.load(std::memory_order_relaxed);
+    if (cached_head_ - tail < max)
+      cached_head_ = head_.load(std::memory_order_acquire);
+    auto available = cached_head_ - tail;
+    auto n = max < available ? max : available;
+    for (std::size_t i=0; i<n; ++i)
+      values[i] = buffer_[(tail + i) & mask_];
+    tail_.store(tail + n, std::memory_order_release);
+    return n;
+  }
+
+  // May be called from any thread, depth is a snapshot
+  std::size_t size() const
+  {
+    return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+  }
+  std::size_t capacity() const { return buffer_.size(); }
+  std::uint64_t overflows() const { return overflows_.load(std::memory_order_relaxed); }
+
+private:
+  static std::size_t round_up(std::size_t n)
+  {
+    std::size_t size = 1;
+    while (size < n)
+      size <<= 1;
+    return size;
+  }
+
+  std::vector<T> buffer_;
+  const std::size_t mask_;
+
+  alignas(cache_line_size) std::atomic<std::size_t> head_{0};  // Written by producer
+  std::size_t cached_tail_{0};  // Producer's view of tail
+  std::atomic<std::uint64_t> overflows_{0};  // Written by producer
+
+  alignas(cache_line_size) std::atomic<std::size_t> tail_{0};  // Written by consumer
+  std::size_t cached_head_{0};  // Consumer's view of head
+};
+
+
+}  // namespace util
+
+
+#endif  // UTIL_RING_H
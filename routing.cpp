@@ -0,0 +1,233 @@
+#include "routing.h"
+
+
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+
+namespace
+{
+
+
+constexpr std::size_t initial_extended_size = 64;
+
+
+canid_t parse_id(const std::string& s, int line)
+{
+  char* end = nullptr;
+  canid_t id = std::strtoul(s.c_str(), &end, 16);
+  if (s.empty() || *end != '\0' || id > CAN_EFF_MASK)
+    throw route::Rule_error{"Invalid ID in line " + std::to_string(line) + ": " + s};
+  if (s.size() >= 8 || id > CAN_SFF_MASK)
+    id |= CAN_EFF_FLAG;
+  return id;
+}
+
+
+std::chrono::nanoseconds parse_interval(const std::string& s, int line)
+{
+  char* end = nullptr;
+  auto ms = std::strtoul(s.c_str(), &end, 10);
+  if (s.empty() || *end != '\0' || ms == 0)
+    throw route::Rule_error{"Invalid interval in line " + std::to_string(line) + ": " + s};
+  return std::chrono::milliseconds{ms};
+}
+
+
+void parse_mask(const std::string& s, int line, route::Policy& policy)
+{
+  if (s.empty() || s.size() % 2 != 0 || s.size() > policy.mask.size() * 2 ||
+      s.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos)
+    throw route::Rule_error{"Invalid mask in line " + std::to_string(line) + ": " + s};
+  for (std::size_t i=0; i<s.size()/2; ++i)
+    policy.mask[i] = std::strtoul(s.substr(i * 2, 2).c_str(), nullptr, 16);
+}
+
+
+// Returns false for text other than a policy
+bool parse_policy(const std::string& s, int line, route::Policy& policy)
+{
+  const auto separator = s.find(':');
+  const auto name = s.substr(0, separator);
+  const auto value = separator == std::string::npos ? "" : s.substr(separator + 1);
+  if (name == "on-change") {
+    policy.on_change = true;
+    if (separator != std::string::npos)
+      parse_mask(value, line, policy);
+  }
+  else if (name == "min-interval" && separator != std::string::npos) {
+    policy.min_interval = parse_interval(value, line);
+  }
+  else if (name == "heartbeat" && separator != std::string::npos) {
+    policy.heartbeat = parse_interval(value, line);
+  }
+  else {
+    return false;
+  }
+  return true;
+}
+
+
+std::uint8_t parse_channel(const std::string& s, int line)
+{
+  char* end = nullptr;
+  auto channel = std::strtoul(s.c_str(), &end, 10);
+  if (s.empty() || *end != '\0' || channel >= route::keep_channel)
+    throw route::Rule_error{"Invalid channel in line " + std::to_string(line) + ": " + s};
+  return channel;
+}
+
+
+}  // namespace
+
+
+route::Table::Table()
+  : extended_(initial_extended_size, Entry{empty_id, Rule{}}),
+    extended_size_{0},
+    size_{0},
+    shift_{32 - 6},
+    default_{Action::forward, keep_channel, 0, 0}
+{
+  standard_.fill(default_);
+}
+
+
+void route::Table::add(canid_t id, const Rule& rule)
+{
+  // A rule for an ID with a rule replaces it
+  if (!(id & CAN_EFF_FLAG)) {
+    if (!standard_used_[id & CAN_SFF_MASK])
+      ++size_;
+    standard_used_[id & CAN_SFF_MASK] = true;
+    standard_[id & CAN_SFF_MASK] = rule;
+    return;
+  }
+
+  id &= CAN_EFF_MASK;
+  if ((extended_size_ + 1) * 2 > extended_.size())
+    grow();  // Keep load factor at or below 0.5 for short probe sequences
+
+  auto i = slot(id);
+  while (extended_[i].id != empty_id && extended_[i].id != id)
+    i = (i + 1) & (extended_.size() - 1);
+  if (extended_[i].id == empty_id) {
+    ++extended_size_;
+    ++size_;
+  }
+  extended_[i] = Entry{id, rule};
+}
+
+
+std::uint16_t route::Table::add_policy(const Policy& policy)
+{
+  if (policies_.size() == 0xFFFF)
+    throw Rule_error{"Too many send policies"};
+  policies_.push_back(policy);
+  return policies_.size();
+}
+
+
+const route::Rule& route::Table::find_extended(canid_t id) const
+{
+  auto i = slot(id);
+  while (extended_[i].id != empty_id) {
+    if (extended_[i].id == id)
+      return extended_[i].rule;
+    i = (i + 1) & (extended_.size() - 1);
+  }
+  return default_;
+}
+
+
+std::size_t route::Table::slot(canid_t id) const
+{
+  return (id * 2654435761u) >> shift_;  // Fibonacci hashing, spreads sequential IDs
+}
+
+
+void route::Table::grow()
+{
+  std::vector<Entry> old(extended_.size() * 2, Entry{empty_id, Rule{}});
+  old.swap(extended_);
+  --shift_;
+  for (const auto& entry : old) {
+    if (entry.id == empty_id)
+      continue;
+    auto i = slot(entry.id);
+    while (extended_[i].id != empty_id)
+      i = (i + 1) & (extended_.size() - 1);
+    extended_[i] = entry;
+  }
+}
+
+
+route::Tables route::load_rules(const std::string& path)
+{
+  std::ifstream file{path};
+  if (!file)
+    throw Rule_error{"Could not open routing rules " + path};
+
+  Tables tables;
+  std::string line;
+  for (int number=1; std::getline(file, line); ++number) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream fields{line};
+    std::string direction, id, action, argument, field;
+    if (!(fields >> direction))
+      continue;  // Empty or comment line
+    fields >> id >> action;
+    if (direction != "to-udp" && direction != "to-can" && direction != "both")
+      throw Rule_error{"Invalid direction in line " + std::to_string(number) + ": " + direction};
+
+    // Policies follow the optional argument, which is never a policy name
+    Policy policy{false, {}, std::chrono::nanoseconds{0}, std::chrono::nanoseconds{0}};
+    policy.mask.fill(0xFF);
+    bool has_policy = false;
+    while (fields >> field) {
+      if (parse_policy(field, number, policy))
+        has_policy = true;
+      else if (argument.empty() && !has_policy)
+        argument = field;
+      else
+        throw Rule_error{"Unexpected text in line " + std::to_string(number) + ": " + field};
+    }
+    if (has_policy && direction != "to-udp")
+      throw Rule_error{"Send policies require to-udp in line " + std::to_string(number)};
+    if (policy.heartbeat.count() > 0 && !policy.on_change)
+      throw Rule_error{"Heartbeat requires on-change in line " + std::to_string(number)};
+
+    Rule rule{Action::forward, keep_channel, 0, 0};
+    if (action == "drop" && argument.empty()) {
+      rule.action = Action::drop;
+    }
+    else if (action == "forward") {
+      if (!argument.empty())
+        rule.channel = parse_channel(argument, number);
+    }
+    else if (action == "rewrite" && !argument.empty()) {
+      rule.action = Action::rewrite;
+      rule.id = parse_id(argument, number);
+    }
+    else if (action == "mirror" && !argument.empty()) {
+      rule.action = Action::mirror;
+      rule.channel = parse_channel(argument, number);
+    }
+    else {
+      throw Rule_error{"Invalid action in line " + std::to_string(number) + ": " + action};
+    }
+
+    if (has_policy && rule.action == Action::drop)
+      throw Rule_error{"Send policies can't be combined with drop in line " +
+          std::to_string(number)};
+    if (has_policy)
+      rule.policy = tables.to_udp.add_policy(policy);
+    const auto can_id = parse_id(id, number);
+    if (direction == "to-udp" || direction == "both")
+      tables.to_udp.add(can_id, rule);
+    if (direction == "to-can" || direction == "both")
+      tables.to_can.add(can_id, rule);
+  }
+
+  return tables;
+}
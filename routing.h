@@ -0,0 +1,140 @@
+/* Per ID routing rules for cangw
+ *
+ * Standard IDs are looked up in a flat table, extended IDs in an open addressing hash table, so
+ * a lookup costs about one or two cache misses. Rules are loaded from a text file with one rule
+ * per line:
+ *
+ *   <direction> <id> <action> [argument] [policy...]
+ *
+ * direction: to-udp, to-can or both
+ * id: hex ID, IDs with 8 digits or above 0x7FF are extended IDs
+ * action: drop, forward [channel], rewrite <hex id>, mirror <channel>
+ * policy: on-change[:<hex mask>], min-interval:<ms>, heartbeat:<ms> (to-udp only, not with drop)
+ *
+ * Channels are positions in the cangw device list, forward without channel keeps the channel and
+ * mirror passes the frame unchanged while sending a copy to the given channel. Text after # is a
+ * comment. IDs without rule are forwarded unchanged.
+ *
+ * Send policies thin out frames of an ID per source channel: on-change passes frames whose length
+ * or payload bytes under the mask (in byte order, missing bytes are FF) differ from the last frame
+ * passed, min-interval drops frames sooner than the interval after the last frame passed and
+ * heartbeat passes an unchanged frame if the last frame passed is at least that old.
+ */
+
+
+#ifndef ROUTE_ROUTING_H
+#define ROUTE_ROUTING_H
+
+
+#include <linux/can.h>
+
+#include <cstdint>
+#include <chrono>
+#include <string>
+#include <array>
+#include <bitset>
+#include <vector>
+#include <stdexcept>
+
+
+namespace route
+{
+
+
+class Rule_error : public std::runtime_error
+{
+public:
+  Rule_error(const std::string& s) : std::runtime_error{s} {}
+  Rule_error(const char* s) : std::runtime_error{s} {}
+};
+
+
+enum class Action : std::uint8_t
+{
+  forward,
+  drop,
+  rewrite,
+  mirror
+};
+
+
+constexpr std::uint8_t keep_channel = 0xFF;
+
+
+struct Rule
+{
+  Action action;
+  std::uint8_t channel;  // Destination of forward or copy of mirror, keep_channel for source
+  std::uint16_t policy;  // Send policy index + 1, 0 if all frames pass
+  canid_t id;  // New ID including CAN_EFF_FLAG for rewrite
+};
+
+
+struct Policy
+{
+  bool on_change;
+  std::array<std::uint8_t, CANFD_MAX_DLEN> mask;  // Payload bytes compared for on-change
+  std::chrono::nanoseconds min_interval;  // 0 if off
+  std::chrono::nanoseconds heartbeat;  // 0 if off
+};
+
+
+class Table
+{
+public:
+  Table();
+
+  void add(canid_t id, const Rule& rule);
+  bool empty() const { return size_ == 0; }
+  std::size_t size() const { return size_; }  // IDs with a rule
+  // Returns the value of Rule::policy
+  std::uint16_t add_policy(const Policy& policy);
+  const Policy& policy(std::uint16_t index) const { return policies_[index - 1]; }
+  std::size_t policies() const { return policies_.size(); }
+
+  // Returns the default forward rule for IDs without rule, flags other than EFF are ignored
+  const Rule& find(canid_t id) const
+  {
+    if (!(id & CAN_EFF_FLAG))
+      return standard_[id & CAN_SFF_MASK];
+    return find_extended(id & CAN_EFF_MASK);
+  }
+
+private:
+  struct Entry
+  {
+    canid_t id;  // empty_id for unused slots
+    Rule rule;
+  };
+
+  static constexpr canid_t empty_id = 0xFFFFFFFF;
+
+  const Rule& find_extended(canid_t id) const;
+  std::size_t slot(canid_t id) const;
+  void grow();
+
+  std::array<Rule, CAN_SFF_MASK + 1> standard_;
+  std::bitset<CAN_SFF_MASK + 1> standard_used_;  // Standard IDs with a rule
+  std::vector<Entry> extended_;  // Power of two size, linear probing
+  std::size_t extended_size_;
+  std::size_t size_;
+  int shift_;  // 32 - log2 of extended table size
+  Rule default_;
+  std::vector<Policy> policies_;
+};
+
+
+struct Tables
+{
+  Table to_udp;
+  Table to_can;
+};
+
+
+Tables load_rules(const std::string& path);
+
+
+}  // namespace route
+
+
+#endif  // ROUTE_ROUTING_H
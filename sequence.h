@@ -0,0 +1,104 @@
+/* Tracks the sequence numbers of a datagram stream: losses, duplicates and reordering, with a
+ * histogram of the gap lengths in powers of 2, recording never allocates
+ *
+ * Sequence numbers within the window behind the highest one received are late datagrams, which
+ * fill in a gap counted as lost before, or duplicates. Numbers further behind restart the stream,
+ * e.g. after a restart of the sender.
+ */
+
+
+#ifndef UTIL_SEQUENCE_H
+#define UTIL_SEQUENCE_H
+
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <bitset>
+#include <algorithm>
+
+
+namespace util
+{
+
+
+class Sequence_tracker
+{
+public:
+  static constexpr std::size_t window = 1024;
+  static constexpr std::size_t gap_buckets = 16;  // 1, 2-3, 4-7, ..., 2^15 and above
+
+  // Returns false for duplicates
+  bool add(std::uint32_t sequence)
+  {
+    ++received_;
+    const auto diff = static_cast<std::int32_t>(sequence - next_);
+    if (!started_ || diff < -static_cast<std::int32_t>(window)) {
+      if (started_)
+        ++restarts_;
+      started_ = true;
+      seen_.reset();
+      advance(sequence);
+      return true;
+    }
+    if (diff < 0) {
+      if (seen_[sequence % window]) {
+        ++duplicates_;
+        --received_;
+        return false;
+      }
+      seen_[sequence % window] = true;
+      ++reordered_;
+      if (lost_ > 0)
+        --lost_;  // Not counted if sent before the stream started
+      return true;
+    }
+    if (diff > 0) {
+      lost_ += diff;
+      ++gaps_[bucket(diff)];
+      for (std::uint32_t i=0; i<std::min<std::uint32_t>(diff, window); ++i)
+        seen_[(next_ + i) % window] = false;
+    }
+    advance(sequence);
+    return true;
+  }
+
+  std::uint64_t received() const { return received_; }  // Without duplicates
+  std::uint64_t lost() const { return lost_; }  // Not received until now, late ones are deducted
+  std::uint64_t duplicates() const { return duplicates_; }
+  std::uint64_t reordered() const { return reordered_; }
+  std::uint64_t restarts() const { return restarts_; }
+  // Gaps of 2^i to 2^(i+1)-1 lost datagrams, counted when detected
+  const std::array<std::uint64_t, gap_buckets>& gaps() const { return gaps_; }
+
+private:
+  static std::size_t bucket(std::uint32_t gap)
+  {
+    std::size_t i = 0;
+    while (gap >>= 1)
+      ++i;
+    return i < gap_buckets ? i : gap_buckets - 1;
+  }
+
+  void advance(std::uint32_t sequence)
+  {
+    seen_[sequence % window] = true;
+    next_ = sequence + 1;
+  }
+
+  bool started_{false};
+  std::uint32_t next_{0};  // Following the highest sequence received
+  std::bitset<window> seen_;  // Of the sequences in the window behind next_
+  std::uint64_t received_{0};
+  std::uint64_t lost_{0};
+  std::uint64_t duplicates_{0};
+  std::uint64_t reordered_{0};
+  std::uint64_t restarts_{0};
+  std::array<std::uint64_t, gap_buckets> gaps_{};
+};
+
+
+}  // namespace util
+
+
+#endif  // UTIL_SEQUENCE_H
@@ -0,0 +1,275 @@
+#include "shmring.h"
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/futex.h>
+
+#include <climits>
+#include <cstring>
+#include <new>
+#include <thread>
+
+
+namespace
+{
+
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+    "Atomics in shared memory must be lock-free");
+
+
+std::string shm_name(const std::string& name)
+{
+  return name.front() == '/' ? name : '/' + name;
+}
+
+
+std::size_t ring_size(std::size_t capacity)
+{
+  return sizeof(shm::Ring_header) + capacity * sizeof(shm::Ring_slot);
+}
+
+
+class Scope_guard
+{
+public:
+  Scope_guard(int fd) : fd_{fd} {}
+  ~Scope_guard() { if (fd_ != -1) ::close(fd_); fd_ = -1; }
+  Scope_guard(const Scope_guard&) = delete;
+  Scope_guard& operator=(const Scope_guard&) = delete;
+  void release() { fd_  = -1; }
+
+private:
+  int fd_;
+};
+
+
+}  // namespace
+
+
+void shm::Ring_writer::open(const std::string& name, std::size_t capacity)
+{
+  if (fd_ != -1)
+    throw Ring_error{"Already open"};
+  if (name.empty() || name.find('/', 1) != std::string::npos)
+    throw Ring_error{"Invalid shared memory name " + name};
+  if (capacity == 0 || capacity > (1u << 24) || (capacity & (capacity - 1)))
+    throw Ring_error{"Ring capacity must be a power of 2 up to 2^24"};
+
+  // A new file, readers still mapping a previous ring keep the old one
+  name_ = shm_name(name);
+  shm_unlink(name_.c_str());
+  fd_ = shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd_ == -1)
+    throw Ring_error{"Could not create shared memory " + name_};
+
+  Scope_guard guard{fd_};
+  size_ = ring_size(capacity);
+  if (ftruncate(fd_, size_) != 0) {
+    shm_unlink(name_.c_str());
+    throw Ring_error{"Could not size shared memory"};
+  }
+  memory_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (memory_ == MAP_FAILED) {
+    memory_ = nullptr;
+    shm_unlink(name_.c_str());
+    throw Ring_error{"Could not map shared memory"};
+  }
+
+  // The file is zeroed, all slots are unwritten
+  header_ = new (memory_) Ring_header;
+  header_->version = ring_version;
+  header_->capacity = capacity;
+  header_->slot_size = sizeof(Ring_slot);
+  header_->head.store(0, std::memory_order_relaxed);
+  header_->futex.store(0, std::memory_order_relaxed);
+  header_->waiters.store(0, std::memory_order_relaxed);
+  slots_ = reinterpret_cast<Ring_slot*>(static_cast<std::uint8_t*>(memory_) + sizeof(Ring_header));
+  mask_ = capacity - 1;
+  head_ = 0;
+  std::atomic_thread_fence(std::memory_order_release);
+  header_->magic = ring_magic;
+
+  guard.release();
+}
+
+
+void shm::Ring_writer::close()
+{
+  if (fd_ == -1)
+    return;
+
+  munmap(memory_, size_);
+  ::close(fd_);
+  shm_unlink(name_.c_str());
+  fd_ = -1;
+  memory_ = nullptr;
+  header_ = nullptr;
+  slots_ = nullptr;
+}
+
+
+void shm::Ring_writer::write(const canfd_frame& frame, std::uint64_t time, std::uint8_t channel)
+{
+  // Readers copying the slot meanwhile see the index change and discard their copy
+  auto& slot = slots_[head_ & mask_];
+  slot.index.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.time = time;
+  slot.channel = channel;
+  slot.frame = frame;
+  slot.index.store(head_ + 1, std::memory_order_release);
+  ++head_;
+}
+
+
+void shm::Ring_writer::publish()
+{
+  if (header_->head.load(std::memory_order_relaxed) == head_)
+    return;
+  // Sequentially consistent with the registration of readers, either the reader sees the new
+  // head or the writer sees the waiter, the syscall is saved while no reader waits
+  header_->head.store(head_);
+  header_->futex.fetch_add(1);
+  if (header_->waiters.load() > 0)
+    syscall(SYS_futex, &header_->futex, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+
+void shm::Ring_reader::open(const std::string& name)
+{
+  if (fd_ != -1)
+    throw Ring_error{"Already open"};
+
+  // Write access is only needed to register as waiter
+  fd_ = shm_open(shm_name(name).c_str(), O_RDWR, 0);
+  const bool writable = fd_ != -1;
+  if (!writable)
+    fd_ = shm_open(shm_name(name).c_str(), O_RDONLY, 0);
+  if (fd_ == -1)
+    throw Ring_error{"Could not open shared memory " + shm_name(name)};
+
+  Scope_guard guard{fd_};
+  struct stat st;
+  if (fstat(fd_, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(Ring_header))
+    throw Ring_error{"Shared memory is not a frame ring"};
+  size_ = st.st_size;
+  memory_ = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+  if (memory_ == MAP_FAILED) {
+    memory_ = nullptr;
+    throw Ring_error{"Could not map shared memory"};
+  }
+
+  header_ = static_cast<const Ring_header*>(memory_);
+  const bool valid = header_->magic == ring_magic;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (!valid || header_->version != ring_version || header_->slot_size != sizeof(Ring_slot) ||
+      size_ < ring_size(header_->capacity)) {
+    munmap(const_cast<void*>(memory_), size_);
+    memory_ = nullptr;
+    throw Ring_error{"Shared memory is not a frame ring of this version"};
+  }
+  if (writable) {
+    void* control = mmap(nullptr, sizeof(Ring_header), PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    control_ = control == MAP_FAILED ? nullptr : static_cast<Ring_header*>(control);
+  }
+  slots_ = reinterpret_cast<const Ring_slot*>(static_cast<const std::uint8_t*>(memory_) +
+      sizeof(Ring_header));
+  capacity_ = header_->capacity;
+  position_ = header_->head.load(std::memory_order_acquire);  // Late readers start at the head
+  overruns_ = 0;
+
+  guard.release();
+}
+
+
+void shm::Ring_reader::close()
+{
+  if (fd_ == -1)
+    return;
+
+  if (control_)
+    munmap(control_, sizeof(Ring_header));
+  munmap(const_cast<void*>(memory_), size_);
+  ::close(fd_);
+  fd_ = -1;
+  memory_ = nullptr;
+  header_ = nullptr;
+  control_ = nullptr;
+  slots_ = nullptr;
+}
+
+
+int shm::Ring_reader::read(canfd_frame* frames, std::uint64_t* times, std::uint8_t* channels,
+    int count)
+{
+  auto head = header_->head.load(std::memory_order_acquire);
+  if (head - position_ > capacity_)
+    skip_ahead(head);
+
+  int n = 0;
+  while (n < count && position_ < head) {
+    const auto& slot = slots_[position_ & (capacity_ - 1)];
+    const auto index = slot.index.load(std::memory_order_acquire);
+    if (index == position_ + 1) {
+      std::memcpy(&frames[n], &slot.frame, sizeof(canfd_frame));
+      const auto time = slot.time;
+      const auto channel = slot.channel;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.index.load(std::memory_order_relaxed) == index) {
+        if (times)
+          times[n] = time;
+        if (channels)
+          channels[n] = channel;
+        ++position_;
+        ++n;
+        continue;
+      }
+    }
+    // Overwritten by the writer, which is a lap ahead
+    head = header_->head.load(std::memory_order_acquire);
+    skip_ahead(head);
+  }
+  return n;
+}
+
+
+bool shm::Ring_reader::wait(std::chrono::milliseconds timeout)
+{
+  if (!control_) {
+    const auto end = std::chrono::steady_clock::now() + timeout;
+    while (header_->head.load(std::memory_order_acquire) == position_ &&
+        std::chrono::steady_clock::now() < end)
+      std::this_thread::sleep_for(ring_poll_interval);
+    return header_->head.load(std::memory_order_acquire) != position_;
+  }
+
+  // The futex changes with each publish after head, a publish in between ends the wait at once
+  control_->waiters.fetch_add(1);
+  const auto futex = control_->futex.load();
+  if (control_->head.load() == position_) {
+    timespec ts;
+    ts.tv_sec = timeout.count() / 1000;
+    ts.tv_nsec = timeout.count() % 1000 * 1'000'000;
+    syscall(SYS_futex, &control_->futex, FUTEX_WAIT, futex, &ts, nullptr, 0);
+  }
+  control_->waiters.fetch_sub(1);
+  return header_->head.load(std::memory_order_acquire) != position_;
+}
+
+
+void shm::Ring_reader::skip_ahead(std::uint64_t head)
+{
+  // Leaves a quarter of the ring as margin to the writer
+  const auto margin = capacity_ - capacity_ / 4;
+  auto position = head > margin ? head - margin : 0;
+  if (position <= position_)
+    position = position_ + 1;
+  overruns_ += position - position_;
+  position_ = position;
+}
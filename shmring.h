@@ -0,0 +1,135 @@
+/* A broadcast ring of CAN frames in shared memory for local readers
+ *
+ * The writer creates the ring as a file in /dev/shm, readers map the slots read-only and never
+ * block the writer. Each slot carries the index of its frame, readers copy frames out and check
+ * the index again to detect that it was overwritten meanwhile, readers that fall behind by more
+ * than the capacity skip ahead and count the lost frames as overruns. Readers start at the head,
+ * earlier frames are not replayed. Published batches are signaled with a shared futex, the writer
+ * only wakes it while readers are registered as waiting, readers without write access to the
+ * ring can't register and poll instead.
+ */
+
+
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+
+#include <linux/can.h>
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <stdexcept>
+
+
+namespace shm
+{
+
+
+class Ring_error : public std::runtime_error
+{
+public:
+  Ring_error(const std::string& s) : std::runtime_error{s} {}
+  Ring_error(const char* s) : std::runtime_error{s} {}
+};
+
+
+struct Ring_header
+{
+  std::uint32_t magic;  // Written last when the ring is ready
+  std::uint32_t version;
+  std::uint32_t capacity;  // Slots, a power of 2
+  std::uint32_t slot_size;
+  alignas(64) std::atomic<std::uint64_t> head;  // Frames published
+  std::atomic<std::uint32_t> futex;  // Incremented with each published batch
+  std::atomic<std::uint32_t> waiters;  // Readers in wait, a killed reader leaves it raised
+};
+
+
+struct Ring_slot
+{
+  std::atomic<std::uint64_t> index;  // Of the frame + 1, 0 while written
+  std::uint64_t time;  // Receive time in ns
+  std::uint8_t channel;  // Position of the CAN device in the gateway's device list
+  canfd_frame frame;
+};
+
+
+constexpr std::uint32_t ring_magic = 0x43414E52;
+constexpr std::uint32_t ring_version = 2;
+constexpr std::chrono::milliseconds ring_poll_interval{1};  // Of readers that can't wait
+
+
+class Ring_writer
+{
+public:
+  Ring_writer() : fd_{-1} {}
+  ~Ring_writer() { close(); }
+
+  Ring_writer(const Ring_writer&) = delete;
+  Ring_writer& operator=(const Ring_writer&) = delete;
+  Ring_writer(Ring_writer&&) = delete;
+  Ring_writer& operator=(Ring_writer&&) = delete;
+
+  // Replaces a ring of the same name, readers of the old one see no more frames
+  void open(const std::string& name, std::size_t capacity);
+  void close();  // Removes the ring
+
+  // Frames become visible to readers with the next publish, which wakes waiting readers
+  void write(const canfd_frame& frame, std::uint64_t time, std::uint8_t channel);
+  void publish();
+
+private:
+  int fd_;
+  std::string name_;
+  void* memory_{nullptr};
+  std::size_t size_{0};
+  Ring_header* header_{nullptr};
+  Ring_slot* slots_{nullptr};
+  std::uint64_t mask_{0};
+  std::uint64_t head_{0};  // Frames written
+};
+
+
+class Ring_reader
+{
+public:
+  Ring_reader() : fd_{-1} {}
+  ~Ring_reader() { close(); }
+
+  Ring_reader(const Ring_reader&) = delete;
+  Ring_reader& operator=(const Ring_reader&) = delete;
+  Ring_reader(Ring_reader&&) = delete;
+  Ring_reader& operator=(Ring_reader&&) = delete;
+
+  void open(const std::string& name);
+  void close();
+
+  // Returns the number of frames read, times and channels may be nullptr
+  int read(canfd_frame* frames, std::uint64_t* times, std::uint8_t* channels, int count);
+  // Waits for frames to read, false if the timeout expired first
+  bool wait(std::chrono::milliseconds timeout);
+  bool can_wait() const { return control_ != nullptr; }  // Polls otherwise
+  std::uint64_t overruns() const { return overruns_; }  // Frames overwritten before read
+
+private:
+  void skip_ahead(std::uint64_t head);
+
+  int fd_;
+  const void* memory_{nullptr};
+  std::size_t size_{0};
+  const Ring_header* header_{nullptr};
+  Ring_header* control_{nullptr};  // Writable mapping of the header to register as waiter
+  const Ring_slot* slots_{nullptr};
+  std::uint64_t capacity_{0};
+  std::uint64_t position_{0};  // Next frame to read
+  std::uint64_t overruns_{0};
+};
+
+
+}  // namespace shm
+
+
+#endif  // SHM_RING_H
@@ -0,0 +1,260 @@
+#include "shmtable.h"
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <new>
+
+
+namespace
+{
+
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+    "Atomics in shared memory must be lock-free");
+
+
+constexpr int max_retries = 1000;  // Of a read racing the writer, a crashed writer stays odd
+
+
+std::string shm_name(const std::string& name)
+{
+  return name.front() == '/' ? name : '/' + name;
+}
+
+
+std::size_t table_size(std::size_t extended_slots)
+{
+  return sizeof(shm::Table_header) + (shm::standard_slots + extended_slots) *
+      sizeof(shm::Table_slot);
+}
+
+
+std::uint32_t hash(std::uint32_t id)
+{
+  // Multiplicative hash, consecutive IDs spread over the region
+  id *= 0x9E3779B1;
+  return id ^ (id >> 16);
+}
+
+
+class Scope_guard
+{
+public:
+  Scope_guard(int fd) : fd_{fd} {}
+  ~Scope_guard() { if (fd_ != -1) ::close(fd_); fd_ = -1; }
+  Scope_guard(const Scope_guard&) = delete;
+  Scope_guard& operator=(const Scope_guard&) = delete;
+  void release() { fd_  = -1; }
+
+private:
+  int fd_;
+};
+
+
+bool read_slot(const shm::Table_slot& slot, shm::Table_entry& entry)
+{
+  for (int i=0; i<max_retries; ++i) {
+    const auto sequence = slot.sequence.load(std::memory_order_acquire);
+    if (sequence & 1)
+      continue;
+    entry.count = slot.count;
+    entry.time = slot.time;
+    entry.channel = slot.channel;
+    std::memcpy(&entry.frame, &slot.frame, sizeof(canfd_frame));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.sequence.load(std::memory_order_relaxed) == sequence)
+      return entry.count > 0;
+  }
+  return false;
+}
+
+
+}  // namespace
+
+
+void shm::Table_writer::open(const std::string& name, std::size_t extended_slots)
+{
+  if (fd_ != -1)
+    throw Table_error{"Already open"};
+  if (name.empty() || name.find('/', 1) != std::string::npos)
+    throw Table_error{"Invalid shared memory name " + name};
+  if (extended_slots == 0 || extended_slots > (1u << 24) ||
+      (extended_slots & (extended_slots - 1)))
+    throw Table_error{"Extended ID slots must be a power of 2 up to 2^24"};
+
+  // A new file, readers still mapping a previous table keep the old one
+  name_ = shm_name(name);
+  shm_unlink(name_.c_str());
+  fd_ = shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd_ == -1)
+    throw Table_error{"Could not create shared memory " + name_};
+
+  Scope_guard guard{fd_};
+  size_ = table_size(extended_slots);
+  if (ftruncate(fd_, size_) != 0) {
+    shm_unlink(name_.c_str());
+    throw Table_error{"Could not size shared memory"};
+  }
+  memory_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (memory_ == MAP_FAILED) {
+    memory_ = nullptr;
+    shm_unlink(name_.c_str());
+    throw Table_error{"Could not map shared memory"};
+  }
+
+  // The file is zeroed, all slots are unused
+  header_ = new (memory_) Table_header;
+  header_->version = table_version;
+  header_->standard_slots = standard_slots;
+  header_->extended_slots = extended_slots;
+  header_->slot_size = sizeof(Table_slot);
+  header_->overflows.store(0, std::memory_order_relaxed);
+  slots_ = reinterpret_cast<Table_slot*>(static_cast<std::uint8_t*>(memory_) +
+      sizeof(Table_header));
+  mask_ = extended_slots - 1;
+  std::atomic_thread_fence(std::memory_order_release);
+  header_->magic = table_magic;
+
+  guard.release();
+}
+
+
+void shm::Table_writer::close()
+{
+  if (fd_ == -1)
+    return;
+
+  munmap(memory_, size_);
+  ::close(fd_);
+  shm_unlink(name_.c_str());
+  fd_ = -1;
+  memory_ = nullptr;
+  header_ = nullptr;
+  slots_ = nullptr;
+}
+
+
+void shm::Table_writer::update(const canfd_frame& frame, std::uint64_t time, std::uint8_t channel)
+{
+  if (frame.can_id & CAN_ERR_FLAG)
+    return;
+
+  Table_slot* slot = nullptr;
+  if (!(frame.can_id & CAN_EFF_FLAG)) {
+    slot = &slots_[frame.can_id & CAN_SFF_MASK];
+  }
+  else {
+    // The only writer, its own slots are read without the seqlock
+    const auto id = frame.can_id & CAN_EFF_MASK;
+    const auto start = hash(id);
+    for (std::uint32_t i=0; i<max_probes && i<=mask_; ++i) {
+      auto& probe = slots_[standard_slots + ((start + i) & mask_)];
+      if (probe.count == 0 || (probe.frame.can_id & CAN_EFF_MASK) == id) {
+        slot = &probe;
+        break;
+      }
+    }
+    if (!slot) {
+      header_->overflows.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+  }
+
+  // Readers copying the slot meanwhile see the sequence change and retry
+  const auto sequence = slot->sequence.load(std::memory_order_relaxed);
+  slot->sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  ++slot->count;
+  slot->time = time;
+  slot->channel = channel;
+  slot->frame = frame;
+  slot->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+
+void shm::Table_reader::open(const std::string& name)
+{
+  if (fd_ != -1)
+    throw Table_error{"Already open"};
+
+  fd_ = shm_open(shm_name(name).c_str(), O_RDONLY, 0);
+  if (fd_ == -1)
+    throw Table_error{"Could not open shared memory " + shm_name(name)};
+
+  Scope_guard guard{fd_};
+  struct stat st;
+  if (fstat(fd_, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(Table_header))
+    throw Table_error{"Shared memory is not a frame table"};
+  size_ = st.st_size;
+  memory_ = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+  if (memory_ == MAP_FAILED) {
+    memory_ = nullptr;
+    throw Table_error{"Could not map shared memory"};
+  }
+
+  header_ = static_cast<const Table_header*>(memory_);
+  const bool valid = header_->magic == table_magic;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (!valid || header_->version != table_version || header_->slot_size != sizeof(Table_slot) ||
+      header_->standard_slots != standard_slots || size_ < table_size(header_->extended_slots)) {
+    munmap(const_cast<void*>(memory_), size_);
+    memory_ = nullptr;
+    throw Table_error{"Shared memory is not a frame table of this version"};
+  }
+  slots_ = reinterpret_cast<const Table_slot*>(static_cast<const std::uint8_t*>(memory_) +
+      sizeof(Table_header));
+  extended_slots_ = header_->extended_slots;
+
+  guard.release();
+}
+
+
+void shm::Table_reader::close()
+{
+  if (fd_ == -1)
+    return;
+
+  munmap(const_cast<void*>(memory_), size_);
+  ::close(fd_);
+  fd_ = -1;
+  memory_ = nullptr;
+  header_ = nullptr;
+  slots_ = nullptr;
+}
+
+
+bool shm::Table_reader::find(canid_t id, Table_entry& entry) const
+{
+  if (!(id & CAN_EFF_FLAG))
+    return read_slot(slots_[id & CAN_SFF_MASK], entry);
+
+  // Slots are claimed in probe order and never freed, an unused slot ends the search
+  id &= CAN_EFF_MASK;
+  const auto start = hash(id);
+  const auto mask = extended_slots_ - 1;
+  for (std::uint32_t i=0; i<max_probes && i<=mask; ++i) {
+    if (!read_slot(slots_[standard_slots + ((start + i) & mask)], entry))
+      return false;
+    if ((entry.frame.can_id & CAN_EFF_FLAG) && (entry.frame.can_id & CAN_EFF_MASK) == id)
+      return true;
+  }
+  return false;
+}
+
+
+bool shm::Table_reader::read(std::size_t slot, Table_entry& entry) const
+{
+  return slot < size() && read_slot(slots_[slot], entry);
+}
+
+
+std::uint64_t shm::Table_reader::overflows() const
+{
+  return header_->overflows.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,135 @@
+/* A table of the last frame of each CAN ID in shared memory for local readers
+ *
+ * The writer creates the table as a file in /dev/shm with one slot per 11-bit ID and a hashed
+ * region of extended IDs with linear probing, slots are never freed. Each slot is guarded by a
+ * seqlock, readers copy a slot and retry if the writer changed it meanwhile, so any number of
+ * readers look up the current state of an ID in O(1) without ever blocking the writer.
+ */
+
+
+#ifndef SHM_TABLE_H
+#define SHM_TABLE_H
+
+
+#include <linux/can.h>
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <string>
+#include <stdexcept>
+
+
+namespace shm
+{
+
+
+class Table_error : public std::runtime_error
+{
+public:
+  Table_error(const std::string& s) : std::runtime_error{s} {}
+  Table_error(const char* s) : std::runtime_error{s} {}
+};
+
+
+struct Table_header
+{
+  std::uint32_t magic;  // Written last when the table is ready
+  std::uint32_t version;
+  std::uint32_t standard_slots;  // Indexed by ID
+  std::uint32_t extended_slots;  // Hashed, a power of 2
+  std::uint32_t slot_size;
+  alignas(64) std::atomic<std::uint64_t> overflows;  // Extended IDs without a free slot
+};
+
+
+struct Table_slot
+{
+  std::atomic<std::uint32_t> sequence;  // Odd while written
+  std::uint32_t reserved;
+  std::uint64_t count;  // Frames of the ID, 0 if the slot is unused
+  std::uint64_t time;  // Receive time in ns of the last frame
+  std::uint8_t channel;  // Position of the CAN device in the gateway's device list
+  canfd_frame frame;
+};
+
+
+struct Table_entry
+{
+  std::uint64_t count;
+  std::uint64_t time;
+  std::uint8_t channel;
+  canfd_frame frame;
+};
+
+
+constexpr std::uint32_t table_magic = 0x43414E54;
+constexpr std::uint32_t table_version = 1;
+constexpr std::uint32_t standard_slots = CAN_SFF_MASK + 1;
+constexpr int max_probes = 32;  // Slots searched for an extended ID
+
+
+class Table_writer
+{
+public:
+  Table_writer() : fd_{-1} {}
+  ~Table_writer() { close(); }
+
+  Table_writer(const Table_writer&) = delete;
+  Table_writer& operator=(const Table_writer&) = delete;
+  Table_writer(Table_writer&&) = delete;
+  Table_writer& operator=(Table_writer&&) = delete;
+
+  // Replaces a table of the same name, readers of the old one see no more updates
+  void open(const std::string& name, std::size_t extended_slots);
+  void close();  // Removes the table
+
+  // Error frames are ignored, frames of an ID on several channels share the slot
+  void update(const canfd_frame& frame, std::uint64_t time, std::uint8_t channel);
+
+private:
+  int fd_;
+  std::string name_;
+  void* memory_{nullptr};
+  std::size_t size_{0};
+  Table_header* header_{nullptr};
+  Table_slot* slots_{nullptr};
+  std::uint32_t mask_{0};  // Of the extended slots
+};
+
+
+class Table_reader
+{
+public:
+  Table_reader() : fd_{-1} {}
+  ~Table_reader() { close(); }
+
+  Table_reader(const Table_reader&) = delete;
+  Table_reader& operator=(const Table_reader&) = delete;
+  Table_reader(Table_reader&&) = delete;
+  Table_reader& operator=(Table_reader&&) = delete;
+
+  void open(const std::string& name);
+  void close();
+
+  // ID with CAN_EFF_FLAG for extended IDs, false if no frame of the ID was written
+  bool find(canid_t id, Table_entry& entry) const;
+  // All slots in order, standard IDs first, false for unused slots
+  std::size_t size() const { return slots_ ? standard_slots + extended_slots_ : 0; }
+  bool read(std::size_t slot, Table_entry& entry) const;
+  std::uint64_t overflows() const;
+
+private:
+  int fd_;
+  const void* memory_{nullptr};
+  std::size_t size_{0};
+  const Table_header* header_{nullptr};
+  const Table_slot* slots_{nullptr};
+  std::uint32_t extended_slots_{0};
+};
+
+
+}  // namespace shm
+
+
+#endif  // SHM_TABLE_H
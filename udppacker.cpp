@@ -0,0 +1,474 @@
+#include "udppacker.h"
+
+
+#include <linux/can.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+#include "cansocket.h"
+#include "lz.h"
+
+
+namespace
+{
+
+
+constexpr std::size_t frame_header_size = offsetof(canfd_frame, data);
+
+
+std::size_t payload_size(const canfd_frame& frame)
+{
+  return frame.flags & CANFD_FDF ? frame.len : CAN_MAX_DLEN;
+}
+
+
+bool tagged(const udp::Format& format)
+{
+  return format.channel && format.version >= 2;
+}
+
+
+constexpr std::uint8_t compact_rtr = 0x80;  // In the length byte of compact records
+
+
+std::uint8_t* put_varint(std::uint8_t* p, std::uint64_t value)
+{
+  while (value >= 0x80) {
+    *p++ = static_cast<std::uint8_t>(value) | 0x80;
+    value >>= 7;
+  }
+  *p++ = value;
+  return p;
+}
+
+
+const std::uint8_t* get_varint(const std::uint8_t* p, const std::uint8_t* end,
+    std::uint64_t& value)
+{
+  // Returns nullptr if the varint is incomplete or too long
+  value = 0;
+  for (int shift=0; p != end && shift < 64; shift += 7) {
+    const auto byte = *p++;
+    value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+      return p;
+  }
+  return nullptr;
+}
+
+
+std::size_t pack_compact(std::uint8_t* data, const canfd_frame& frame, std::uint64_t time,
+    std::uint8_t channel, const udp::Format& format, std::uint64_t previous_time,
+    const std::uint8_t* reference)
+{
+  auto* p = data;
+  if (format.timestamp) {
+    // Zigzag keeps small negative differences short, times of multiple channels may interleave
+    const auto delta = static_cast<std::int64_t>(time - previous_time);
+    p = put_varint(p, (static_cast<std::uint64_t>(delta) << 1) ^ (delta >> 63));
+  }
+  if (tagged(format))
+    *p++ = channel;
+  const bool fd = frame.flags & CANFD_FDF;
+  p = put_varint(p, static_cast<std::uint64_t>(frame.can_id & CAN_EFF_MASK) << 3 |
+      (frame.can_id & CAN_ERR_FLAG ? 4 : 0) | (fd ? 2 : 0) | (frame.can_id & CAN_EFF_FLAG ? 1 : 0));
+  const auto len = std::min<std::uint8_t>(frame.len, fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN);
+  *p++ = len | (frame.can_id & CAN_RTR_FLAG ? compact_rtr : 0);
+  if (fd)
+    *p++ = frame.flags & ~CANFD_FDF;
+  std::memcpy(p, frame.data, len);
+  if (reference) {
+    for (int i=0; i<len; ++i)
+      p[i] ^= reference[i];
+  }
+  return p + len - data;
+}
+
+
+const std::uint8_t* unpack_compact(const std::uint8_t* p, const std::uint8_t* end,
+    bool timestamp, bool channel, canfd_frame& frame, std::uint64_t& time,
+    std::uint8_t& frame_channel)
+{
+  // Returns the end of the record, nullptr if invalid or incomplete, time holds the previous time
+  std::uint64_t value;
+  if (timestamp) {
+    if (!(p = get_varint(p, end, value)))
+      return nullptr;
+    time += static_cast<std::uint64_t>(static_cast<std::int64_t>(value >> 1) ^
+        -static_cast<std::int64_t>(value & 1));
+  }
+  if (channel) {
+    if (p == end)
+      return nullptr;
+    frame_channel = *p++;
+  }
+  if (!(p = get_varint(p, end, value)) || p == end)
+    return nullptr;
+  const bool fd = value & 2;
+  frame.can_id = (value >> 3 & CAN_EFF_MASK) | (value & 4 ? CAN_ERR_FLAG : 0) |
+      (value & 1 ? CAN_EFF_FLAG : 0);
+  const auto len_byte = *p++;
+  frame.len = len_byte & ~compact_rtr;
+  if (len_byte & compact_rtr)
+    frame.can_id |= CAN_RTR_FLAG;
+  frame.flags = 0;
+  if (fd) {
+    if (p == end)
+      return nullptr;
+    frame.flags = *p++ | CANFD_FDF;
+  }
+  if (frame.len > (fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN) ||
+      static_cast<std::size_t>(end - p) < frame.len)
+    return nullptr;
+  frame.__res0 = 0;
+  frame.__res1 = 0;
+  std::memcpy(frame.data, p, frame.len);
+  std::memset(frame.data + frame.len, 0, (fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN) - frame.len);
+  return p + frame.len;
+}
+
+
+int unpack_records(const std::uint8_t* data, std::size_t size, bool timestamp, bool channel,
+    bool compact, bool milliseconds, udp::Payload_table* table, canfd_frame* frames,
+    std::uint64_t* times, std::uint8_t* channels, int count, std::size_t& consumed)
+{
+  // Payloads of compressed streams are restored with the table, which is updated as well
+  const auto* begin = data;
+  int n = 0;
+  if (compact) {
+    const auto* end = data + size;
+    std::uint64_t time = 0;
+    std::uint8_t frame_channel = 0;
+    while (n < count && data != end) {
+      auto& frame = frames[n];
+      auto* next = unpack_compact(data, end, timestamp, channel, frame, time, frame_channel);
+      if (!next)
+        break;
+      if (table) {
+        if (const auto* reference = table->find(frame.can_id, frame_channel)) {
+          for (int i=0; i<frame.len; ++i)
+            frame.data[i] ^= reference[i];
+        }
+        table->update(frame, frame_channel);
+      }
+      if (times)
+        times[n] = timestamp ? time : 0;
+      if (channels)
+        channels[n] = frame_channel;
+      data = next;
+      ++n;
+    }
+    consumed = data - begin;
+    return n;
+  }
+
+  const std::size_t time_size = timestamp ? sizeof(std::uint64_t) : 0;
+  const std::size_t prefix_size = time_size + (channel ? 1 : 0);
+  while (n < count && size >= prefix_size + frame_header_size) {
+    auto& frame = frames[n];
+    std::memcpy(&frame, data + prefix_size, frame_header_size);
+    auto max_len = frame.flags & CANFD_FDF ? CANFD_MAX_DLEN : CAN_MAX_DLEN;
+    auto record = prefix_size + frame_header_size + payload_size(frame);
+    if (frame.len > max_len || size < record)
+      break;
+    if (times) {
+      times[n] = 0;
+      if (timestamp) {
+        std::memcpy(&times[n], data, sizeof(std::uint64_t));
+        if (milliseconds)
+          times[n] *= 1'000'000ull;
+      }
+    }
+    if (channels)
+      channels[n] = channel ? data[time_size] : 0;
+    // FD frames are padded to the next DLC length on the bus, the padding must not be stale
+    std::memcpy(frame.data, data + prefix_size + frame_header_size, payload_size(frame));
+    std::memset(frame.data + payload_size(frame), 0, max_len - payload_size(frame));
+    data += record;
+    size -= record;
+    ++n;
+  }
+  consumed = data - begin;
+  return n;
+}
+
+
+std::size_t header_size(const udp::Header& header)
+{
+  return sizeof(header) + (header.flags & udp::header_flag_sequence ? udp::sequence_size : 0);
+}
+
+
+}  // namespace
+
+
+udp::Payload_table::Payload_table() : standard_(CAN_SFF_MASK + 1), hashed_(hashed_slots) {}
+
+
+const std::uint8_t* udp::Payload_table::find(std::uint32_t can_id, std::uint8_t channel) const
+{
+  const auto* slot = probe(can_id, channel);
+  return slot && slot->generation == generation_ ? slot->payload.data() : nullptr;
+}
+
+
+void udp::Payload_table::update(const canfd_frame& frame, std::uint8_t channel)
+{
+  auto* slot = const_cast<Slot*>(probe(frame.can_id, channel));
+  if (!slot)
+    return;
+
+  // Zero padded, the next payload of the ID may be longer
+  slot->generation = generation_;
+  slot->can_id = frame.can_id;
+  slot->channel = channel;
+  auto& payload = slot->payload;
+  const auto len = std::min<std::size_t>(frame.len, payload.size());
+  std::memcpy(payload.data(), frame.data, len);
+  std::memset(payload.data() + len, 0, payload.size() - len);
+}
+
+
+void udp::Payload_table::clear()
+{
+  // Keyframes don't touch the slots, only a wrapped generation could match stale ones
+  if (++generation_ == 0) {
+    for (auto& slot : standard_)
+      slot.generation = 0;
+    for (auto& slot : hashed_)
+      slot.generation = 0;
+    generation_ = 1;
+  }
+}
+
+
+const udp::Payload_table::Slot* udp::Payload_table::probe(std::uint32_t can_id,
+    std::uint8_t channel) const
+{
+  if (channel == 0 && can_id <= CAN_SFF_MASK)
+    return &standard_[can_id];
+
+  // Fibonacci hashing, slots are claimed in probe order and only freed by a new generation
+  const std::uint32_t start = ((can_id ^ channel * 0x9E3779B9u) * 2654435761u) >> (32 - hashed_bits);
+  for (int i=0; i<max_probes; ++i) {
+    const auto& slot = hashed_[(start + i) & (hashed_slots - 1)];
+    if (slot.generation != generation_ || (slot.can_id == can_id && slot.channel == channel))
+      return &slot;
+  }
+  return nullptr;
+}
+
+
+std::size_t udp::pack_header(std::uint8_t* data, const Format& format)
+{
+  if (format.version < 2)
+    return 0;
+
+  Header header;
+  header.magic = header_magic;
+  header.version = format.version;
+  header.flags = (format.timestamp ? header_flag_timestamp : 0) |
+      (format.timestamp && format.hardware_time ? header_flag_hardware_time : 0) |
+      (format.channel ? header_flag_channel : 0) |
+      (format.compressed && format.version >= 3 ? header_flag_delta : 0) |
+      (format.sequence ? header_flag_sequence : 0);
+  header.sequence = 0;
+  std::memcpy(data, &header, sizeof(header));
+  if (format.sequence)
+    std::memset(data + sizeof(header), 0, sequence_size);
+  return header_size(header);
+}
+
+
+void udp::set_stream_sequence(std::uint8_t* data, std::uint32_t sequence)
+{
+  std::memcpy(data + sizeof(Header), &sequence, sequence_size);
+}
+
+
+bool udp::stream_sequence(const std::uint8_t* data, std::size_t size, std::uint32_t& sequence)
+{
+  Header header;
+  if (size < sizeof(header) + sequence_size)
+    return false;
+  std::memcpy(&header, data, sizeof(header));
+  if (header.magic != header_magic || header.version < 2 || header.version > 3 ||
+      !(header.flags & header_flag_sequence))
+    return false;
+  std::memcpy(&sequence, data + sizeof(header), sequence_size);
+  return true;
+}
+
+
+std::size_t udp::pack(std::uint8_t* data, const canfd_frame& frame, std::uint64_t time,
+    std::uint8_t channel, const Format& format, std::uint64_t previous_time,
+    const std::uint8_t* reference)
+{
+  if (format.version >= 3)
+    return pack_compact(data, frame, time, channel, format, previous_time, reference);
+
+  auto* p = data;
+  if (format.timestamp) {
+    if (format.version < 2)
+      time /= 1'000'000ull;  // Milliseconds for version 1 consumers
+    std::memcpy(p, &time, sizeof(time));
+    p += sizeof(time);
+  }
+  if (tagged(format))
+    *p++ = channel;
+  auto size = frame_header_size + payload_size(frame);
+  std::memcpy(p, &frame, size);  // Classic frames share the can_frame layout
+  return p + size - data;
+}
+
+
+int udp::unpack(const std::uint8_t* data, std::size_t size, const Format& format,
+    canfd_frame* frames, std::uint64_t* times, std::uint8_t* channels, int count,
+    std::size_t* consumed)
+{
+  const auto* begin = data;
+  bool timestamp = format.timestamp;
+  bool channel = false;
+  bool compact = false;
+  if (format.version >= 2) {
+    Header header;
+    if (size < sizeof(header))
+      return 0;
+    std::memcpy(&header, data, sizeof(header));
+    if (header.magic != header_magic || header.version < 2 || header.version > 3 ||
+        header.flags & header_flag_delta)
+      return 0;
+    if (size < header_size(header))
+      return 0;
+    timestamp = header.flags & header_flag_timestamp;
+    channel = header.flags & header_flag_channel;
+    compact = header.version == 3;
+    data += header_size(header);
+    size -= header_size(header);
+  }
+
+  std::size_t records = 0;
+  auto n = unpack_records(data, size, timestamp, channel, compact, format.version < 2, nullptr,
+      frames, times, channels, count, records);
+  if (consumed)
+    *consumed = data + records - begin;
+  return n;
+}
+
+
+udp::Packer::Packer(std::size_t max_size, std::chrono::microseconds max_delay,
+    const Format& format, std::chrono::milliseconds keyframe_interval)
+  : format_(format),
+    max_size_{std::min(std::max(max_size, max_single_size()), max_datagram_size)},
+    max_delay_{max_delay},
+    keyframe_interval_{keyframe_interval}
+{
+  buffer_.reserve(max_size_ + max_record_size);  // Records are written in place
+  format_.compressed = format_.compressed && format_.version >= 3;
+  format_.sequence = format_.sequence && format_.version >= 2;
+  if (format_.compressed)
+    compressed_.resize(util::lz_bound(max_size_));
+}
+
+
+bool udp::Packer::append(const canfd_frame& frame, std::uint64_t time, std::uint8_t channel)
+{
+  if (buffer_.empty()) {
+    buffer_.resize(sizeof(Header) + sequence_size);
+    header_size_ = pack_header(buffer_.data(), format_);
+    buffer_.resize(header_size_);
+    auto now = Clock::now();
+    deadline_ = now + max_delay_;
+    keyframe_ = format_.compressed && now >= next_keyframe_;
+    if (keyframe_) {
+      table_.clear();
+      next_keyframe_ = now + keyframe_interval_;
+    }
+  }
+
+  // Records are written in place and removed again if the datagram would be too large
+  auto offset = buffer_.size();
+  buffer_.resize(offset + max_record_size);
+  const auto* reference = format_.compressed ? table_.find(frame.can_id, channel) : nullptr;
+  auto size = pack(buffer_.data() + offset, frame, time, channel, format_, last_time_, reference);
+  if (offset + size > max_size_) {
+    buffer_.resize(offset);
+    return false;
+  }
+  buffer_.resize(offset + size);
+  last_time_ = time;
+  if (format_.compressed)
+    table_.update(frame, channel);
+  return true;
+}
+
+
+void udp::Packer::finish()
+{
+  if (buffer_.empty())
+    return;
+  if (format_.sequence)
+    set_stream_sequence(buffer_.data(), stream_sequence_++);
+  if (!format_.compressed)
+    return;
+
+  // Records that don't get smaller are sent as they are
+  auto* header = reinterpret_cast<Header*>(buffer_.data());
+  header->sequence = sequence_++;
+  if (keyframe_)
+    header->flags |= header_flag_keyframe;
+  auto records = buffer_.size() - header_size_;
+  auto size = util::lz_compress(buffer_.data() + header_size_, records, compressed_.data());
+  if (size < records) {
+    header->flags |= header_flag_lz;
+    std::memcpy(buffer_.data() + header_size_, compressed_.data(), size);
+    buffer_.resize(header_size_ + size);
+  }
+}
+
+
+udp::Unpacker::Unpacker() : buffer_(max_datagram_size) {}
+
+
+int udp::Unpacker::unpack(const std::uint8_t* data, std::size_t size, const Format& format,
+    canfd_frame* frames, std::uint64_t* times, std::uint8_t* channels, int count)
+{
+  Header header;
+  if (format.version < 2 || size < sizeof(header))
+    return udp::unpack(data, size, format, frames, times, channels, count);
+  std::memcpy(&header, data, sizeof(header));
+  if (header.magic != header_magic || header.version != 3 || !(header.flags & header_flag_delta))
+    return udp::unpack(data, size, format, frames, times, channels, count);
+
+  // Payloads behind a lost datagram can't be restored until the next keyframe
+  if (header.flags & header_flag_keyframe) {
+    table_.clear();
+    synced_ = true;
+  }
+  else if (!synced_ || header.sequence != next_sequence_) {
+    synced_ = false;
+    ++dropped_;
+    return 0;
+  }
+  next_sequence_ = header.sequence + 1;
+
+  if (size < header_size(header))
+    return 0;
+  const auto* records = data + header_size(header);
+  auto records_size = size - header_size(header);
+  if (header.flags & header_flag_lz) {
+    records_size = util::lz_decompress(records, records_size, buffer_.data(), buffer_.size());
+    records = buffer_.data();
+  }
+  std::size_t consumed = 0;
+  auto n = unpack_records(records, records_size, header.flags & header_flag_timestamp,
+      header.flags & header_flag_channel, true, false, &table_, frames, times, channels, count,
+      consumed);
+  if (records_size == 0 || consumed != records_size) {
+    synced_ = false;  // The table misses the payloads of the remaining records
+    ++dropped_;
+  }
+  return n;
+}
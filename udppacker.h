@@ -0,0 +1,212 @@
+/* Packing of multiple CAN frames into a single UDP datagram
+ *
+ * A packed datagram is a plain concatenation of records, each record is identical to the payload
+ * of an unpacked datagram, i.e. the frame with an optional 8-byte timestamp prefix. Classic frames
+ * are sent as the 16-byte can_frame, CAN FD frames as the 8-byte canfd_frame header marked with
+ * CANFD_FDF followed by exactly len payload bytes.
+ *
+ * Wire version 1 has no datagram header and millisecond timestamps. Wire version 2 starts each
+ * datagram with a 4-byte header describing the records, timestamps are in nanoseconds and the
+ * timestamp may be followed by a 1-byte channel of the source CAN interface. All fields use host
+ * byte order, like the frames themselves.
+ *
+ * Wire version 3 uses the version 2 header with compact records: the timestamp as a zigzag varint
+ * of the difference to the previous record of the datagram (to 0 for the first), the channel, the
+ * ID as a varint of can_id without flags << 3 | error << 2 | CAN FD << 1 | extended, a byte with
+ * the length and the RTR flag in bit 7, the CAN FD flags byte for CAN FD frames and len payload
+ * bytes. Varints are little endian base 128.
+ *
+ * Compressed version 3 streams XOR each payload with the previous payload of the same ID and
+ * channel (zero padded) and LZ compress the records, see lz.h. Decoding depends on all previous
+ * datagrams since the last keyframe, the header byte after the flags counts datagrams to detect
+ * losses, datagrams behind a loss are dropped until the next keyframe resets the payload table.
+ *
+ * The header of versions 2 and 3 may be followed by a 4-byte sequence number of the stream,
+ * counting all datagrams of the sender, to tell losses, duplicates and reordering on the network
+ * apart from silence on the bus.
+ */
+
+
+#ifndef UDP_PACKER_H
+#define UDP_PACKER_H
+
+
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <array>
+#include <vector>
+
+
+struct canfd_frame;
+
+
+namespace udp
+{
+
+
+constexpr std::size_t max_datagram_size = 65507;  // IPv4 UDP payload limit
+// Timestamp, channel, ID, length and flags, payload of compact records, 1 more than the others
+constexpr std::size_t max_record_size = 10 + 1 + 5 + 2 + 64;
+// ID and length of a compact record without timestamp and channel, bounds the records of a datagram
+constexpr std::size_t min_record_size = 2;
+
+
+struct Header
+{
+  std::uint8_t magic;
+  std::uint8_t version;
+  std::uint8_t flags;
+  std::uint8_t sequence;  // Of compressed streams, 0 otherwise
+};
+
+constexpr std::uint8_t header_magic = 0xCA;
+constexpr std::uint8_t header_flag_timestamp = 0x01;  // Records are prefixed with a timestamp
+constexpr std::uint8_t header_flag_hardware_time = 0x02;  // Timestamps taken by the CAN device
+constexpr std::uint8_t header_flag_channel = 0x04;  // Records are tagged with a CAN channel
+constexpr std::uint8_t header_flag_delta = 0x08;  // Payloads XORed with the previous one of the ID
+constexpr std::uint8_t header_flag_keyframe = 0x10;  // Payload table reset before the records
+constexpr std::uint8_t header_flag_lz = 0x20;  // Records are LZ compressed
+constexpr std::uint8_t header_flag_sequence = 0x40;  // Stream sequence number after the header
+constexpr std::size_t sequence_size = 4;
+
+
+struct Format
+{
+  int version;  // Wire version 1, 2 or 3 (compact)
+  bool timestamp;  // Ignored when unpacking version 2, the header describes the records
+  bool hardware_time;
+  bool channel;  // Version 2 only
+  bool compressed;  // Version 3 only, ignored when unpacking, the header tells
+  bool sequence;  // Version 2 and 3 only, ignored when unpacking
+};
+
+
+// Last payload per ID and channel of a compressed stream, standard IDs of channel 0 are indexed
+// directly, all others are hashed into a fixed region, IDs without a free slot stay uncompressed
+// alike on both ends of the stream since both see the same IDs in the same order
+class Payload_table
+{
+public:
+  Payload_table();
+
+  // nullptr if the ID wasn't seen since the last keyframe
+  const std::uint8_t* find(std::uint32_t can_id, std::uint8_t channel) const;
+  void update(const canfd_frame& frame, std::uint8_t channel);
+  void clear();  // Starts a new generation, slots of older ones are free
+
+private:
+  struct Slot
+  {
+    std::uint32_t generation;
+    std::uint32_t can_id;
+    std::uint8_t channel;
+    std::array<std::uint8_t, 64> payload;
+  };
+
+  static constexpr int hashed_bits = 10;
+  static constexpr std::size_t hashed_slots = std::size_t{1} << hashed_bits;
+  static constexpr int max_probes = 16;
+
+  // Slot of the ID or the free slot it would take, nullptr if all probed slots are taken
+  const Slot* probe(std::uint32_t can_id, std::uint8_t channel) const;
+
+  std::vector<Slot> standard_;
+  std::vector<Slot> hashed_;
+  std::uint32_t generation_{1};
+};
+
+
+// Largest datagram holding a single record
+inline std::size_t max_single_size() { return sizeof(Header) + sequence_size + max_record_size; }
+
+// Writes the datagram header and returns its size, 0 for version 1, the sequence number is 0
+std::size_t pack_header(std::uint8_t* data, const Format& format);
+// Of a datagram with a header written for a format with sequence numbers
+void set_stream_sequence(std::uint8_t* data, std::uint32_t sequence);
+// False if the datagram has no sequence number
+bool stream_sequence(const std::uint8_t* data, std::size_t size, std::uint32_t& sequence);
+
+// Writes a single record and returns its size, data must hold at least max_record_size bytes,
+// time is in ns, compact records store the difference to the previous time of the datagram,
+// the payload of compressed records is XORed with the reference payload if not null
+std::size_t pack(std::uint8_t* data, const canfd_frame& frame, std::uint64_t time,
+    std::uint8_t channel, const Format& format, std::uint64_t previous_time = 0,
+    const std::uint8_t* reference = nullptr);
+
+// Unpacks a datagram and returns number of frames extracted, stops at the first invalid or
+// incomplete record, times are in ns, untagged records are channel 0, times and channels may be
+// nullptr, consumed is set to the bytes parsed, versions 2 and 3 are told apart by the header,
+// compressed datagrams need the stream state of an Unpacker and aren't unpacked
+int unpack(const std::uint8_t* data, std::size_t size, const Format& format, canfd_frame* frames,
+    std::uint64_t* times, std::uint8_t* channels, int count, std::size_t* consumed = nullptr);
+
+
+class Packer
+{
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // Compressed streams start a keyframe when the interval has passed since the last one
+  Packer(std::size_t max_size, std::chrono::microseconds max_delay, const Format& format,
+      std::chrono::milliseconds keyframe_interval = std::chrono::seconds{1});
+
+  // False if the frame doesn't fit
+  bool append(const canfd_frame& frame, std::uint64_t time, std::uint8_t channel = 0);
+  bool expired(Clock::time_point now) const { return !empty() && now >= deadline_; }
+  std::chrono::microseconds remaining(Clock::time_point now) const
+  {
+    return std::chrono::duration_cast<std::chrono::microseconds>(deadline_ - now);
+  }
+  bool empty() const { return buffer_.empty(); }
+
+  // Numbers the datagram and compresses the records of compressed streams, called once before
+  // data and size
+  void finish();
+  const std::uint8_t* data() const { return buffer_.data(); }
+  std::size_t size() const { return buffer_.size(); }
+  void clear() { buffer_.clear(); last_time_ = 0; }
+
+private:
+  Format format_;
+  std::size_t max_size_;
+  std::chrono::microseconds max_delay_;
+  Clock::time_point deadline_;
+  std::vector<std::uint8_t> buffer_;
+  std::uint64_t last_time_{0};  // Of the last record, compact records store differences
+  std::size_t header_size_{0};
+  std::uint32_t stream_sequence_{0};
+
+  std::chrono::milliseconds keyframe_interval_;
+  Clock::time_point next_keyframe_;
+  bool keyframe_{false};  // Of the current datagram
+  std::uint8_t sequence_{0};
+  Payload_table table_;
+  std::vector<std::uint8_t> compressed_;
+};
+
+
+// Unpacks the datagrams of a single stream, plain ones like unpack, compressed ones with the
+// payload table of the stream
+class Unpacker
+{
+public:
+  Unpacker();
+
+  int unpack(const std::uint8_t* data, std::size_t size, const Format& format,
+      canfd_frame* frames, std::uint64_t* times, std::uint8_t* channels, int count);
+  std::uint64_t dropped() const { return dropped_; }  // Compressed datagrams lost or undecodable
+
+private:
+  Payload_table table_;
+  std::vector<std::uint8_t> buffer_;  // Decompressed datagram
+  std::uint8_t next_sequence_{0};
+  bool synced_{false};  // Since the last keyframe
+  std::uint64_t dropped_{0};
+};
+
+
+}  // namespace udp
+
+
+#endif  // UDP_PACKER_H
@@ -6,14 +6,34 @@
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <netinet/udp.h>
 #include <unistd.h>
 #include <linux/can.h>
 
+#include <algorithm>
+#include <cstring>
+
+#include "uring.h"
+
 
 namespace
 {
 
 
+int interface_index(const std::string& interface)
+{
+  if (interface.empty())
+    return 0;
+  auto index = if_nametoindex(interface.c_str());
+  if (index == 0)
+    throw udp::Socket_error{"Unknown interface " + interface};
+  return index;
+}
+
+
+constexpr std::size_t gro_control_size = CMSG_SPACE(sizeof(int));
+
+
 class Scope_guard
 {
 public:
@@ -31,6 +51,13 @@ private:
 }  // namespace
 
 
+bool udp::is_multicast(const std::string& ip)
+{
+  in_addr addr;
+  return inet_aton(ip.c_str(), &addr) != 0 && IN_MULTICAST(ntohl(addr.s_addr));
+}
+
+
 void udp::Socket::open(const std::string& ip, std::uint16_t port)
 {
   if (fd_ != -1)
@@ -86,6 +113,54 @@ void udp::Socket::bind(const std::string& ip, std::uint16_t port)
 }
 
 
+void udp::Socket::add_destination(const std::string& ip, std::uint16_t port)
+{
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+
+  if (inet_aton(ip.c_str(), &addr.sin_addr) == 0)
+    throw Socket_error{"Error resolving IP address"};
+
+  addr.sin_port = htons(port);
+  destinations_.push_back(addr);
+
+  // Every message of a fan-out carries the same payload
+  tx_msgs_.assign(destinations_.size() + 1, mmsghdr{});
+  for (std::size_t i=0; i<tx_msgs_.size(); ++i) {
+    tx_msgs_[i].msg_hdr.msg_name = i == 0 ? &addr_ : &destinations_[i - 1];
+    tx_msgs_[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+    tx_msgs_[i].msg_hdr.msg_iovlen = 1;
+  }
+}
+
+
+void udp::Socket::set_multicast(int ttl, bool loopback, const std::string& interface)
+{
+  const int loop = loopback ? 1 : 0;
+  if (setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) != 0 ||
+      setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) != 0)
+    throw Socket_error{"Error setting multicast options"};
+
+  if (!interface.empty()) {
+    ip_mreqn mreq{};
+    mreq.imr_ifindex = interface_index(interface);
+    if (setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq)) != 0)
+      throw Socket_error{"Error setting multicast interface"};
+  }
+}
+
+
+void udp::Socket::join_multicast(const std::string& group, const std::string& interface)
+{
+  ip_mreqn mreq{};
+  if (inet_aton(group.c_str(), &mreq.imr_multiaddr) == 0)
+    throw Socket_error{"Error resolving IP address"};
+  mreq.imr_ifindex = interface_index(interface);
+  if (setsockopt(fd_, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0)
+    throw Socket_error{"Error joining multicast group " + group};
+}
+
+
 void udp::Socket::set_receive_timeout(time_t timeout)
 {
   if (timeout <= 0)
@@ -99,17 +174,105 @@ void udp::Socket::set_receive_timeout(time_t timeout)
 }
 
 
+int udp::Socket::set_receive_buffer(int size)
+{
+  if (setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) != 0)
+    throw Socket_error{"Error setting receive buffer size"};
+  socklen_t len = sizeof(size);
+  getsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &size, &len);
+  return size;
+}
+
+
+int udp::Socket::set_send_buffer(int size)
+{
+  if (setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) != 0)
+    throw Socket_error{"Error setting send buffer size"};
+  socklen_t len = sizeof(size);
+  getsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &size, &len);
+  return size;
+}
+
+
+bool udp::Socket::set_busy_poll(std::chrono::microseconds time)
+{
+  const int param = time.count();
+  return setsockopt(fd_, SOL_SOCKET, SO_BUSY_POLL, &param, sizeof(param)) == 0;
+}
+
+
+bool udp::Socket::supports_gso() const
+{
+  int size;
+  socklen_t len = sizeof(size);
+  return getsockopt(fd_, SOL_UDP, UDP_SEGMENT, &size, &len) == 0;
+}
+
+
+bool udp::Socket::set_gro(bool enable)
+{
+  const int value = enable ? 1 : 0;
+  return setsockopt(fd_, SOL_UDP, UDP_GRO, &value, sizeof(value)) == 0;
+}
+
+
 int udp::Socket::transmit(const std::vector<std::uint8_t>& data)
 {
-  return sendto(fd_, data.data(), data.size(), 0, reinterpret_cast<sockaddr*>(&addr_),
-      sizeof(addr_));
+  return transmit_all(data.data(), data.size());
+}
+
+
+int udp::Socket::transmit(const std::uint8_t* data, std::size_t size)
+{
+  return transmit_all(data, size);
 }
 
 
 int udp::Socket::transmit(const can_frame* frame)
 {
-  return sendto(fd_, frame, sizeof(can_frame), 0, reinterpret_cast<sockaddr*>(&addr_),
-      sizeof(addr_));
+  return transmit_all(frame, sizeof(can_frame));
+}
+
+
+int udp::Socket::transmit(const std::uint8_t* data, std::size_t size, std::uint16_t segment_size)
+{
+  // Returns size if sent to all destinations, -1 otherwise, a destination rejecting the segments
+  // (e.g. larger than its path MTU) gets them one by one instead
+  alignas(cmsghdr) std::uint8_t control[CMSG_SPACE(sizeof(segment_size))] = {};
+  iovec iov{const_cast<std::uint8_t*>(data), size};
+  msghdr msg{};
+  msg.msg_namelen = sizeof(sockaddr_in);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  auto* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_UDP;
+  cmsg->cmsg_type = UDP_SEGMENT;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(segment_size));
+  std::memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+
+  auto send = [&](sockaddr_in& destination) {
+    msg.msg_name = &destination;
+    if (sendmsg(fd_, &msg, 0) >= 0)
+      return true;
+    bool sent = true;
+    for (std::size_t offset=0; offset<size; offset+=segment_size) {
+      sent = sendto(fd_, data + offset, std::min<std::size_t>(segment_size, size - offset), 0,
+          reinterpret_cast<sockaddr*>(&destination), sizeof(destination)) >= 0 && sent;
+    }
+    return sent;
+  };
+  bool failed = !send(addr_);
+  for (auto& destination : destinations_)
+    failed = !send(destination) || failed;
+  return failed ? -1 : static_cast<int>(size);
+}
+
+
+int udp::Socket::receive(std::uint8_t* data, std::size_t size)
+{
+  return recv(fd_, data, size, 0);
 }
 
 
@@ -119,8 +282,157 @@ int udp::Socket::receive(can_frame* frame)
 }
 
 
+int udp::Socket::receive_batch(std::uint8_t* data, std::size_t size, std::size_t* sizes,
+    int count, std::size_t* segments, sockaddr_in* sources)
+{
+  // Receive all queued datagrams with a single syscall, blocks only until the first one arrives
+  prepare_receive_batch(count);
+  for (int i=0; i<count; ++i) {
+    rx_iovs_[i].iov_base = data + i * size;
+    rx_iovs_[i].iov_len = size;
+    rx_msgs_[i].msg_hdr.msg_flags = 0;
+    rx_msgs_[i].msg_hdr.msg_name = sources ? &sources[i] : nullptr;
+    rx_msgs_[i].msg_hdr.msg_namelen = sources ? sizeof(sockaddr_in) : 0;
+    rx_msgs_[i].msg_hdr.msg_control = segments ? &rx_control_[i * gro_control_size] : nullptr;
+    rx_msgs_[i].msg_hdr.msg_controllen = segments ? gro_control_size : 0;
+  }
+
+  auto n = recvmmsg(fd_, rx_msgs_.data(), count, receive_flags_, nullptr);
+
+  // Truncated datagrams are passed as empty
+  for (int i=0; i<n; ++i) {
+    auto& msg = rx_msgs_[i].msg_hdr;
+    sizes[i] = msg.msg_flags & MSG_TRUNC ? 0 : rx_msgs_[i].msg_len;
+    if (!segments)
+      continue;
+    segments[i] = 0;
+    for (auto* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+        int segment_size;
+        std::memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(segment_size));
+        segments[i] = segment_size;
+      }
+    }
+  }
+
+  return n;
+}
+
+
+int udp::Socket::transmit(event::Uring& uring, const std::uint8_t* data, std::size_t size)
+{
+  uring.send(fd_, data, size, reinterpret_cast<sockaddr*>(&addr_), sizeof(addr_));
+  for (auto& destination : destinations_)
+    uring.send(fd_, data, size, reinterpret_cast<sockaddr*>(&destination), sizeof(destination));
+  return size;
+}
+
+
+void udp::Socket::receive_multishot(event::Uring& uring, std::size_t size, int count,
+    Datagram_handler handler)
+{
+  uring.add_receive(fd_, size, count, sizeof(sockaddr_in), 0,
+      [handler](const msghdr& msg, std::size_t size) {
+    const auto* data = static_cast<const std::uint8_t*>(msg.msg_iov->iov_base);
+    sockaddr_in source{};
+    std::memcpy(&source, msg.msg_name, std::min<std::size_t>(msg.msg_namelen, sizeof(source)));
+    handler(data, msg.msg_flags & MSG_TRUNC ? 0 : size, source);
+  });
+}
+
+
+void udp::Socket::prepare_receive_batch(int count)
+{
+  if (count <= static_cast<int>(rx_msgs_.size()))
+    return;
+
+  rx_msgs_.assign(count, mmsghdr{});
+  rx_iovs_.assign(count, iovec{});
+  rx_control_.assign(count * gro_control_size, 0);
+  for (int i=0; i<count; ++i) {
+    rx_msgs_[i].msg_hdr.msg_iov = &rx_iovs_[i];
+    rx_msgs_[i].msg_hdr.msg_iovlen = 1;
+  }
+}
+
+
+int udp::Socket::transmit_all(const void* data, std::size_t size)
+{
+  if (destinations_.empty())
+    return sendto(fd_, data, size, 0, reinterpret_cast<sockaddr*>(&addr_), sizeof(addr_));
+
+  // Returns size if the datagram was sent to all destinations, -1 otherwise, a failing
+  // destination is skipped so that it doesn't starve the others
+  iovec iov{const_cast<void*>(data), size};
+  for (auto& msg : tx_msgs_)
+    msg.msg_hdr.msg_iov = &iov;
+  bool failed = false;
+  std::size_t sent = 0;
+  while (sent < tx_msgs_.size()) {
+    auto n = sendmmsg(fd_, tx_msgs_.data() + sent, tx_msgs_.size() - sent, 0);
+    if (n <= 0) {
+      failed = true;
+      n = 1;
+    }
+    sent += n;
+  }
+  return failed ? -1 : static_cast<int>(size);
+}
+
+
+void udp::Socket::queue(const std::uint8_t* data, std::size_t size)
+{
+  tx_queue_.insert(tx_queue_.end(), data, data + size);
+  tx_queue_sizes_.push_back(size);
+}
+
+
+int udp::Socket::transmit_queued()
+{
+  const auto count = tx_queue_sizes_.size();
+  if (count == 0)
+    return 0;
+
+  // Messages are built once the payloads don't move anymore, the vectors keep their capacity
+  const auto destinations = destinations_.size() + 1;
+  tx_queue_iovs_.resize(count);
+  tx_queue_msgs_.assign(count * destinations, mmsghdr{});
+  std::size_t offset = 0;
+  for (std::size_t i=0; i<count; ++i) {
+    tx_queue_iovs_[i] = iovec{tx_queue_.data() + offset, tx_queue_sizes_[i]};
+    offset += tx_queue_sizes_[i];
+    for (std::size_t j=0; j<destinations; ++j) {
+      auto& hdr = tx_queue_msgs_[i * destinations + j].msg_hdr;
+      hdr.msg_name = j == 0 ? &addr_ : &destinations_[j - 1];
+      hdr.msg_namelen = sizeof(sockaddr_in);
+      hdr.msg_iov = &tx_queue_iovs_[i];
+      hdr.msg_iovlen = 1;
+    }
+  }
+
+  // A failing message is skipped so that it doesn't starve the others
+  bool failed = false;
+  std::size_t sent = 0;
+  while (sent < tx_queue_msgs_.size()) {
+    auto n = sendmmsg(fd_, tx_queue_msgs_.data() + sent, tx_queue_msgs_.size() - sent, 0);
+    if (n <= 0) {
+      failed = true;
+      n = 1;
+    }
+    sent += n;
+  }
+  tx_queue_.clear();
+  tx_queue_sizes_.clear();
+  return failed ? -1 : static_cast<int>(count);
+}
+
+
 void udp::Socket::reset()
 {
   fd_ = -1;
   addr_ = sockaddr_in{};
+  destinations_.clear();
+  tx_msgs_.clear();
+  tx_queue_.clear();
+  tx_queue_sizes_.clear();
 }
@@ -6,14 +6,23 @@
 #include <netinet/in.h>
 
 #include <cstdint>
+#include <cstddef>
 #include <string>
+#include <chrono>
 #include <vector>
+#include <functional>
 #include <stdexcept>
 
 
 struct can_frame;
 
 
+namespace event
+{
+class Uring;
+}
+
+
 namespace udp
 {
 
@@ -26,9 +35,20 @@ public:
 };
 
 
+constexpr int max_segments = 64;  // Datagrams per GSO send, UDP_MAX_SEGMENTS of older kernels
+constexpr std::size_t max_coalesced_size = 65535;  // Receive buffer size for GRO
+
+
+// True for addresses of 224.0.0.0/4
+bool is_multicast(const std::string& ip);
+
+
 class Socket
 {
 public:
+  using Datagram_handler = std::function<void(const std::uint8_t* data, std::size_t size,
+      const sockaddr_in& source)>;
+
   Socket() : fd_{-1} {}
   ~Socket() { close(); }
 
@@ -39,20 +59,72 @@ public:
 
   void open(const std::string& ip, std::uint16_t port);
   void close();
+  int fd() const { return fd_; }  // For registering with an event loop
 
   void bind();
   void bind(const std::string& ip, std::uint16_t port);
+  // Further destinations of transmitted datagrams, transmit sends a datagram to all of them with
+  // one sendmmsg, transmit_queued all queued datagrams to all of them
+  void add_destination(const std::string& ip, std::uint16_t port);
+  // Multicast transmit options, interface is a device name, the routing table decides if empty
+  void set_multicast(int ttl, bool loopback, const std::string& interface = "");
+  // Receives datagrams sent to the group on the interface, any interface if empty
+  void join_multicast(const std::string& group, const std::string& interface = "");
   void set_receive_timeout(time_t timeout);
+  // Socket buffer sizes in bytes, return the size granted by the kernel (which doubles the value)
+  int set_receive_buffer(int size);
+  int set_send_buffer(int size);
+  // Batch receives return -1 (EAGAIN) instead of blocking if no datagram is queued
+  void set_receive_wait(bool wait) { receive_flags_ = wait ? MSG_WAITFORONE : MSG_DONTWAIT; }
+  // Polls the device queue on receive, returns false if not permitted (CAP_NET_ADMIN)
+  bool set_busy_poll(std::chrono::microseconds time);
+  // UDP segmentation offload, false if not supported by the kernel (before 4.18)
+  bool supports_gso() const;
+  // Datagrams of a sender may be received coalesced, false if not supported (before 5.0)
+  bool set_gro(bool enable);
 
   int transmit(const std::vector<std::uint8_t>& data);
+  int transmit(const std::uint8_t* data, std::size_t size);
   int transmit(const can_frame* frame);
+  // Sends size bytes as datagrams of segment size, the last may be shorter, with one syscall per
+  // destination, at most max_segments datagrams, one by one to destinations rejecting them
+  int transmit(const std::uint8_t* data, std::size_t size, std::uint16_t segment_size);
+  // Copies the datagram until the next transmit_queued, which sends the datagrams of a batch to
+  // every destination with a single sendmmsg (more above UIO_MAXIOV messages), returns the
+  // number of datagrams if all were sent to every destination, -1 otherwise
+  void queue(const std::uint8_t* data, std::size_t size);
+  int transmit_queued();
+  int receive(std::uint8_t* data, std::size_t size);
   int receive(can_frame* frame);
+  // Receives up to count datagrams of max size bytes each into consecutive slots of data, with
+  // GRO segments is set to the size of the datagrams coalesced in each slot, 0 if not coalesced,
+  // sources to the sender of each slot
+  int receive_batch(std::uint8_t* data, std::size_t size, std::size_t* sizes, int count,
+      std::size_t* segments = nullptr, sockaddr_in* sources = nullptr);
+
+  // io_uring engine, sends are copied and submitted with the next batch, receives stay posted
+  // with count buffers of max size bytes, truncated datagrams are passed as empty
+  int transmit(event::Uring& uring, const std::uint8_t* data, std::size_t size);
+  void receive_multishot(event::Uring& uring, std::size_t size, int count,
+      Datagram_handler handler);
 
 private:
   void reset();
+  void prepare_receive_batch(int count);
+  int transmit_all(const void* data, std::size_t size);  // To every destination
 
   int fd_;
   sockaddr_in addr_;
+  std::vector<sockaddr_in> destinations_;  // Besides addr_
+  std::vector<mmsghdr> tx_msgs_;
+  std::vector<std::uint8_t> tx_queue_;  // Payloads of the queued datagrams
+  std::vector<std::size_t> tx_queue_sizes_;
+  std::vector<iovec> tx_queue_iovs_;
+  std::vector<mmsghdr> tx_queue_msgs_;  // Each queued datagram to each destination
+  std::vector<mmsghdr> rx_msgs_;
+  std::vector<iovec> rx_iovs_;
+  std::vector<std::uint8_t> rx_control_;  // Segment size of coalesced datagrams
+  int receive_flags_{MSG_WAITFORONE};
 };
 
 
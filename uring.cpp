@@ -0,0 +1,458 @@
+#include "uring.h"
+
+
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+
+namespace
+{
+
+
+int io_uring_setup(unsigned entries, io_uring_params* params)
+{
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+
+int io_uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, fd, submit, wait, flags, nullptr, 0);
+}
+
+
+int io_uring_register(int fd, unsigned opcode, void* arg, unsigned count)
+{
+  return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+
+constexpr std::size_t align(std::size_t size)
+{
+  return (size + 7) & ~std::size_t{7};  // Keeps the ancillary data aligned for CMSG macros
+}
+
+
+}  // namespace
+
+
+struct event::Uring::Operation
+{
+  enum class Type {poll, receive, send, wake};
+
+  explicit Operation(Type t) : type{t} {}
+  virtual ~Operation() = default;
+
+  Type type;
+  int fd{-1};
+  std::uint32_t events{0};
+  Handler handler;
+};
+
+
+struct event::Uring::Receive : Operation
+{
+  Receive() : Operation{Type::receive} {}
+  ~Receive() override { if (ring) munmap(ring, ring_size); }
+
+  Receive_handler on_message;
+  msghdr msg{};  // Only the name and control sizes are used by multishot receives
+  std::size_t payload_size{0};
+  std::size_t buffer_size{0};  // Receive header, name, control and payload
+  std::uint16_t group{0};
+  unsigned count{0};
+  io_uring_buf_ring* ring{nullptr};
+  std::size_t ring_size{0};
+  std::vector<std::uint8_t> buffers;
+};
+
+
+struct event::Uring::Send : Operation
+{
+  Send() : Operation{Type::send} {}
+
+  msghdr msg{};
+  iovec iov{};
+  sockaddr_storage addr{};
+  std::vector<std::uint8_t> data;
+};
+
+
+event::Uring::Uring() : ring_fd_{-1}, wake_fd_{-1}, stop_{false}
+{
+}
+
+
+event::Uring::~Uring()
+{
+  close();
+}
+
+
+void event::Uring::open(unsigned entries)
+{
+  if (ring_fd_ != -1)
+    throw Uring_error{"Already open"};
+
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  ring_fd_ = io_uring_setup(entries, &params);
+  if (ring_fd_ == -1)
+    throw Uring_error{"Could not create io_uring, kernel too old?"};
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap)
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+
+  sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    sq_ring_ = nullptr;
+    close();
+    throw Uring_error{"Could not map submission queue"};
+  }
+  cq_ring_ = single_mmap ? sq_ring_ : mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+  if (cq_ring_ == MAP_FAILED) {
+    cq_ring_ = nullptr;
+    close();
+    throw Uring_error{"Could not map completion queue"};
+  }
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  auto* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      ring_fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    close();
+    throw Uring_error{"Could not map submission queue entries"};
+  }
+  sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+  auto* sq = static_cast<std::uint8_t*>(sq_ring_);
+  auto* cq = static_cast<std::uint8_t*>(cq_ring_);
+  sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sq_entries_ = params.sq_entries;
+  cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+  // Entries are always submitted in order, the indirection array stays an identity mapping
+  auto* array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  for (unsigned i=0; i<sq_entries_; ++i)
+    array[i] = i;
+
+  wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (wake_fd_ == -1) {
+    close();
+    throw Uring_error{"Could not create eventfd"};
+  }
+  auto wake = std::make_unique<Operation>(Operation::Type::wake);
+  wake->fd = wake_fd_;
+  wake->events = POLLIN;
+  post_poll(wake.get());
+  operations_.push_back(std::move(wake));
+
+  stop_.store(false);
+}
+
+
+void event::Uring::close()
+{
+  // Buffers must not be picked by receives still in flight while the ring is torn down
+  for (const auto& op : operations_) {
+    if (op->type != Operation::Type::receive || ring_fd_ == -1)
+      continue;
+    io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.bgid = static_cast<Receive*>(op.get())->group;
+    io_uring_register(ring_fd_, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+  }
+
+  if (sqes_)
+    munmap(sqes_, sqes_size_);
+  if (cq_ring_ && cq_ring_ != sq_ring_)
+    munmap(cq_ring_, cq_ring_size_);
+  if (sq_ring_)
+    munmap(sq_ring_, sq_ring_size_);
+  if (wake_fd_ != -1)
+    ::close(wake_fd_);
+  if (ring_fd_ != -1)
+    ::close(ring_fd_);
+
+  ring_fd_ = -1;
+  wake_fd_ = -1;
+  sq_ring_ = nullptr;
+  cq_ring_ = nullptr;
+  sqes_ = nullptr;
+  pending_ = 0;
+  next_group_ = 0;
+  operations_.clear();
+  sends_.clear();
+  free_sends_.clear();
+}
+
+
+void event::Uring::add(int fd, std::uint32_t events, Handler handler)
+{
+  auto op = std::make_unique<Operation>(Operation::Type::poll);
+  op->fd = fd;
+  op->events = events;
+  op->handler = std::move(handler);
+  post_poll(op.get());
+  operations_.push_back(std::move(op));
+}
+
+
+void event::Uring::add_receive(int fd, std::size_t payload_size, int count, socklen_t name_size,
+    std::size_t control_size, Receive_handler handler)
+{
+  if (count <= 0 || count > 32768 || (count & (count - 1)) != 0)
+    throw Uring_error{"Receive buffer count must be a power of two up to 32768"};
+
+  auto receive = std::make_unique<Receive>();
+  receive->fd = fd;
+  receive->on_message = std::move(handler);
+  receive->msg.msg_namelen = align(name_size);
+  receive->msg.msg_controllen = align(control_size);
+  receive->payload_size = payload_size;
+  receive->buffer_size = align(sizeof(io_uring_recvmsg_out) + receive->msg.msg_namelen +
+      receive->msg.msg_controllen + payload_size);
+  receive->group = next_group_;
+  receive->count = count;
+  receive->buffers.assign(receive->buffer_size * count, 0);
+
+  // The buffer ring must be page aligned, the kernel takes buffers from its head
+  receive->ring_size = count * sizeof(io_uring_buf);
+  auto* ring = mmap(nullptr, receive->ring_size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED)
+    throw Uring_error{"Could not allocate receive buffer ring"};
+  receive->ring = static_cast<io_uring_buf_ring*>(ring);
+
+  io_uring_buf_reg reg;
+  std::memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = reinterpret_cast<std::uint64_t>(ring);
+  reg.ring_entries = count;
+  reg.bgid = receive->group;
+  if (io_uring_register(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+    throw Uring_error{"Could not register receive buffers, kernel too old?"};
+  ++next_group_;
+
+  for (int i=0; i<count; ++i)
+    recycle(receive.get(), i);
+  post_receive(receive.get());
+  operations_.push_back(std::move(receive));
+}
+
+
+void event::Uring::send(int fd, const void* data, std::size_t size, const sockaddr* addr,
+    socklen_t addr_size)
+{
+  if (free_sends_.empty()) {
+    sends_.push_back(std::make_unique<Send>());
+    free_sends_.push_back(sends_.back().get());
+  }
+  auto* send = free_sends_.back();
+  free_sends_.pop_back();
+
+  const auto* bytes = static_cast<const std::uint8_t*>(data);
+  send->data.assign(bytes, bytes + size);
+  std::memcpy(&send->addr, addr, std::min<std::size_t>(addr_size, sizeof(send->addr)));
+  send->iov.iov_base = send->data.data();
+  send->iov.iov_len = size;
+  send->msg.msg_name = &send->addr;
+  send->msg.msg_namelen = addr_size;
+  send->msg.msg_iov = &send->iov;
+  send->msg.msg_iovlen = 1;
+
+  auto* sqe = next_sqe();
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<std::uint64_t>(&send->msg);
+  sqe->len = 1;
+  sqe->user_data = reinterpret_cast<std::uint64_t>(static_cast<Operation*>(send));
+}
+
+
+void event::Uring::run()
+{
+  while (!stop_.load()) {
+    // Everything prepared since the last round is submitted with the wait for completions
+    if (enter(pending_, 1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      throw Uring_error{"Error while waiting for completions"};
+
+    auto head = *cq_head_;
+    auto tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    while (head != tail && !stop_.load()) {
+      const auto cqe = cqes_[head & cq_mask_];
+      __atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+      complete(cqe);
+    }
+  }
+}
+
+
+void event::Uring::stop()
+{
+  stop_.store(true);
+  const std::uint64_t value = 1;
+  if (write(wake_fd_, &value, sizeof(value)) != sizeof(value)) {
+    // Counter overflow only, the loop is woken up already
+  }
+}
+
+
+io_uring_sqe* event::Uring::next_sqe()
+{
+  auto tail = *sq_tail_;
+  if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_) {
+    if (enter(pending_, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      throw Uring_error{"Error while submitting requests"};
+    if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_)
+      throw Uring_error{"Submission queue full"};
+  }
+
+  // Without SQPOLL the kernel only reads entries in io_uring_enter, the tail may move first
+  auto* sqe = &sqes_[tail & sq_mask_];
+  std::memset(sqe, 0, sizeof(*sqe));
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  ++pending_;
+  return sqe;
+}
+
+
+int event::Uring::enter(unsigned submit, unsigned wait)
+{
+  auto submitted = io_uring_enter(ring_fd_, submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+  if (submitted > 0)
+    pending_ -= std::min<unsigned>(submitted, pending_);
+  return submitted;
+}
+
+
+void event::Uring::post_poll(Operation* op)
+{
+  auto* sqe = next_sqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = op->fd;
+  sqe->poll32_events = op->events;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = reinterpret_cast<std::uint64_t>(op);
+}
+
+
+void event::Uring::post_receive(Receive* receive)
+{
+  auto* sqe = next_sqe();
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = receive->fd;
+  sqe->addr = reinterpret_cast<std::uint64_t>(&receive->msg);
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = receive->group;
+  sqe->user_data = reinterpret_cast<std::uint64_t>(static_cast<Operation*>(receive));
+}
+
+
+void event::Uring::complete(const io_uring_cqe& cqe)
+{
+  // Multishot requests stay posted as long as the kernel sets IORING_CQE_F_MORE
+  auto* op = reinterpret_cast<Operation*>(cqe.user_data);
+  const bool more = cqe.flags & IORING_CQE_F_MORE;
+  switch (op->type) {
+    case Operation::Type::wake: {
+      std::uint64_t value;
+      if (read(wake_fd_, &value, sizeof(value)) != sizeof(value)) {
+        // Already reset by an earlier completion
+      }
+      if (!more)
+        post_poll(op);
+      break;
+    }
+    case Operation::Type::poll:
+      if (cqe.res == -ECANCELED)
+        return;
+      if (cqe.res < 0)
+        throw Uring_error{"Error polling file descriptor"};
+      op->handler(cqe.res);
+      if (!more)
+        post_poll(op);
+      break;
+    case Operation::Type::receive:
+      complete_receive(static_cast<Receive*>(op), cqe);
+      break;
+    case Operation::Type::send:
+      free_sends_.push_back(static_cast<Send*>(op));  // Errors are ignored as with sendto
+      break;
+  }
+}
+
+
+void event::Uring::complete_receive(Receive* receive, const io_uring_cqe& cqe)
+{
+  if (cqe.res >= 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+    // Buffer layout: receive header, name, control, payload
+    std::uint16_t id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    auto* buffer = receive->buffers.data() + id * receive->buffer_size;
+    const auto* out = reinterpret_cast<const io_uring_recvmsg_out*>(buffer);
+    auto* name = buffer + sizeof(io_uring_recvmsg_out);
+    auto* control = name + receive->msg.msg_namelen;
+    auto* payload = control + receive->msg.msg_controllen;
+
+    iovec iov;
+    iov.iov_base = payload;
+    iov.iov_len = std::min<std::size_t>(out->payloadlen, receive->payload_size);
+    msghdr msg{};
+    msg.msg_name = name;
+    msg.msg_namelen = out->namelen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = out->controllen > 0 ? control : nullptr;
+    msg.msg_controllen = out->controllen;
+    msg.msg_flags = out->flags;
+    if (out->payloadlen > receive->payload_size)
+      msg.msg_flags |= MSG_TRUNC;
+
+    receive->on_message(msg, iov.iov_len);
+    recycle(receive, id);
+  }
+  else if (cqe.res == -ECANCELED) {
+    return;
+  }
+  else if (cqe.res < 0 && cqe.res != -ENOBUFS) {
+    throw Uring_error{"Error receiving message"};
+  }
+
+  // Ends after errors or when the kernel ran out of buffers, which are all recycled by now
+  if (!(cqe.flags & IORING_CQE_F_MORE))
+    post_receive(receive);
+}
+
+
+void event::Uring::recycle(Receive* receive, std::uint16_t id)
+{
+  // The tail overlays the reserved field of the first entry and is written last, entries are
+  // addressed directly as the flexible array member is offset by its empty struct in C++
+  auto* ring = receive->ring;
+  auto tail = ring->tail;
+  auto& buffer = reinterpret_cast<io_uring_buf*>(ring)[tail & (receive->count - 1)];
+  buffer.addr = reinterpret_cast<std::uint64_t>(receive->buffers.data() +
+      id * receive->buffer_size);
+  buffer.len = receive->buffer_size;
+  buffer.bid = id;
+  __atomic_store_n(&ring->tail, static_cast<std::uint16_t>(tail + 1), __ATOMIC_RELEASE);
+}
@@ -0,0 +1,112 @@
+/* An io_uring event loop, receives stay posted as multishot requests on kernel managed buffers and
+ * sends are submitted in batches with the next wait for completions
+ */
+
+
+#ifndef EVENT_URING_H
+#define EVENT_URING_H
+
+
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <string>
+#include <stdexcept>
+
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+
+namespace event
+{
+
+
+class Uring_error : public std::runtime_error
+{
+public:
+  Uring_error(const std::string& s) : std::runtime_error{s} {}
+  Uring_error(const char* s) : std::runtime_error{s} {}
+};
+
+
+class Uring
+{
+public:
+  using Handler = std::function<void(std::uint32_t events)>;
+  // Message as returned by recvmsg, only valid until the handler returns
+  using Receive_handler = std::function<void(const msghdr& msg, std::size_t size)>;
+
+  // Out of line, operations are incomplete types here
+  Uring();
+  ~Uring();
+
+  Uring(const Uring&) = delete;
+  Uring& operator=(const Uring&) = delete;
+  Uring(Uring&&) = delete;
+  Uring& operator=(Uring&&) = delete;
+
+  void open(unsigned entries = 256);  // Submission queue size
+  void close();
+
+  // Handlers are called from the thread running the loop, events is a POLLIN etc. mask
+  void add(int fd, std::uint32_t events, Handler handler);
+  // Keeps a multishot recvmsg posted with count buffers (power of two), name and control sizes as
+  // set in msghdr for recvmsg
+  void add_receive(int fd, std::size_t payload_size, int count, socklen_t name_size,
+      std::size_t control_size, Receive_handler handler);
+  // The datagram is copied, the send is submitted with the next batch
+  void send(int fd, const void* data, std::size_t size, const sockaddr* addr,
+      socklen_t addr_size);
+
+  void run();  // Submits and completes requests until stop is called
+  void stop();  // Thread-safe, wakes up the loop immediately
+
+private:
+  struct Operation;
+  struct Receive;
+  struct Send;
+
+  io_uring_sqe* next_sqe();
+  int enter(unsigned submit, unsigned wait);
+  void post_poll(Operation* op);
+  void post_receive(Receive* receive);
+  void complete(const io_uring_cqe& cqe);
+  void complete_receive(Receive* receive, const io_uring_cqe& cqe);
+  void recycle(Receive* receive, std::uint16_t id);
+
+  int ring_fd_;
+  int wake_fd_;  // eventfd for stop requests from other threads
+  std::atomic<bool> stop_;
+  void* sq_ring_{nullptr};
+  std::size_t sq_ring_size_{0};
+  void* cq_ring_{nullptr};
+  std::size_t cq_ring_size_{0};
+  io_uring_sqe* sqes_{nullptr};
+  std::size_t sqes_size_{0};
+  unsigned* sq_head_{nullptr};
+  unsigned* sq_tail_{nullptr};
+  unsigned sq_mask_{0};
+  unsigned sq_entries_{0};
+  unsigned* cq_head_{nullptr};
+  unsigned* cq_tail_{nullptr};
+  unsigned cq_mask_{0};
+  io_uring_cqe* cqes_{nullptr};
+  unsigned pending_{0};  // Prepared but not yet submitted requests
+  std::uint16_t next_group_{0};  // Buffer group ID of the next receive
+  std::vector<std::unique_ptr<Operation>> operations_;
+  std::vector<std::unique_ptr<Send>> sends_;
+  std::vector<Send*> free_sends_;
+};
+
+
+}  // namespace event
+
+
+#endif  // EVENT_URING_H